@@ -0,0 +1,427 @@
+/*
+ * Microbenchmarks for cobby's primitives; 'make bench' to run.
+ *
+ * cobby.c is included rather than linked so that its static parsing
+ * and lookup functions can be called directly. All allocations in the
+ * process, libc's own included, go through the malloc() wrappers below
+ * so that we can report them per operation.
+ */
+#include "cobby.c"
+#include "curses.h"
+#include "nobby-ui.h"
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long nallocs;
+
+void *malloc(size_t size)
+{
+	nallocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	nallocs++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	nallocs++;
+	return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+	__libc_free(p);
+}
+
+/* lineedit.c wants these from the UI */
+struct global_conf G;
+struct editor *texted;
+void cmd_execute(char *cmdbuf, void *d) {}
+void screen_resize(void) {}
+void view_toggle(void) {}
+
+/* run each benchmark for at least this long */
+#define BENCH_NS 200000000ULL
+
+struct bench {
+	const char *b_name;
+	void (*b_setup)(void);
+	/* do @n operations, return the number actually done */
+	unsigned long (*b_run)(unsigned long n);
+	void (*b_teardown)(void);
+};
+
+static struct obbysess *bsess;
+
+static int __quiet(void *priv, struct obbyevent *oe)
+{
+	return 0;
+}
+
+static void sess_setup(void)
+{
+	char cmd[128];
+	int i;
+
+	bsess = calloc(1, sizeof(struct obbysess));
+	bsess->os_sock = -1;
+	bsess->os_type = OSTYPE_CLIENT;
+	bsess->os_state = OSSTATE_SYNCED;
+	obbysess_set_notify_callback(bsess, __quiet, NULL);
+
+	for (i = 0; i < 200; i++) {
+		snprintf(cmd, sizeof(cmd), "net6_client_join:%x:user%d:1:%x:"
+				"ff00ff", i + 1, i, i + 1);
+		parse_command(bsess, cmd);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(cmd, sizeof(cmd), "obby_document_create:1:%x:"
+				"document%d.c:0:UTF-8", i, i);
+		parse_command(bsess, cmd);
+	}
+}
+
+static void sess_teardown(void)
+{
+	obbysess_destroy(bsess);
+	bsess = NULL;
+}
+
+static const char chat_text[] =
+	"so: the build on C:\\work\\nobby broke again: see "
+	"http://example.org:8080/log for details, or ask in the channel";
+static char *escaped;
+
+static void escape_setup(void)
+{
+	escaped = obby_escape_string(chat_text, 0);
+}
+
+static void escape_teardown(void)
+{
+	free(escaped);
+}
+
+static unsigned long run_escape(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		free(obby_escape_string(chat_text, 0));
+
+	return n;
+}
+
+static unsigned long run_unescape(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		free(obby_unescape_string(escaped, 0));
+
+	return n;
+}
+
+static unsigned long run_find_user(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		if (!obbyuser_find_by_name(bsess, "user123", 7))
+			abort();
+
+	return n;
+}
+
+static unsigned long run_find_user_uid(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		if (!obbyuser_find(bsess, 150))
+			abort();
+
+	return n;
+}
+
+static unsigned long run_find_doc(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		if (!obbydoc_find_by_name(bsess, "document777.c"))
+			abort();
+
+	return n;
+}
+
+static unsigned long run_find_doc_id(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		if (!obbydoc_find(bsess, 1, 777))
+			abort();
+
+	return n;
+}
+
+static unsigned long run_parse_message(unsigned long n)
+{
+	static const char msg[] = "obby_message:7b:hello everyone\\d how "
+		"is the build going?";
+	char cmd[sizeof(msg)];
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		memcpy(cmd, msg, sizeof(msg));
+		parse_command(bsess, cmd);
+	}
+
+	return n;
+}
+
+/* a mixed stream like the one seen in a busy session */
+#define STREAM_CMDS 1024
+static char *stream;
+
+static void stream_setup(void)
+{
+	size_t len = 0, size = STREAM_CMDS * 96;
+	int i;
+
+	sess_setup();
+	stream = malloc(size);
+
+	for (i = 0; i < STREAM_CMDS; i++)
+		switch (i % 4) {
+			case 0:
+				len += sprintf(stream + len, "obby_message:%x:"
+						"line %d of the chat\\d ok\n",
+						i % 200 + 1, i);
+				break;
+
+			case 1:
+				len += sprintf(stream + len, "obby_document:1 %x:"
+						"record:%x:%x:0:ins:%x:abc\n",
+						i % 1000, i % 200 + 1, i, i);
+				break;
+
+			case 2:
+				len += sprintf(stream + len, "net6_ping\n");
+				break;
+
+			case 3:
+				len += sprintf(stream + len, "obby_document:1 %x:"
+						"record:%x:%x:0:del:%x:1\n",
+						i % 1000, i % 200 + 1, i, i);
+				break;
+		}
+}
+
+static void stream_teardown(void)
+{
+	free(stream);
+	sess_teardown();
+}
+
+static unsigned long run_parse_inbuf(unsigned long n)
+{
+	unsigned long i;
+
+	n = (n + STREAM_CMDS - 1) / STREAM_CMDS;
+	for (i = 0; i < n; i++) {
+		bsess->os_inlen = strlen(stream);
+		__reserve(&bsess->os_inbuf, &bsess->os_insize,
+				bsess->os_inlen + 1);
+		memcpy(bsess->os_inbuf, stream, bsess->os_inlen + 1);
+		parse_inbuf(bsess);
+
+		/* don't let replies to net6_ping pile up */
+		bsess->os_outq[OBBY_PRIO_CONTROL].oq_tail = 0;
+	}
+
+	return n * STREAM_CMDS;
+}
+
+/* the same, with events queued and pulled rather than called back */
+static void stream_pull_setup(void)
+{
+	stream_setup();
+	obbysess_set_notify_callback(bsess, NULL, NULL);
+}
+
+static unsigned long run_parse_inbuf_pull(unsigned long n)
+{
+	struct obbyevent oe;
+	unsigned long done;
+
+	done = run_parse_inbuf(n);
+	while (obbysess_next_event(bsess, &oe))
+		;
+
+	return done;
+}
+
+static struct editor *bed;
+static char *chunk;
+
+#define CHUNK_LINES 64
+
+static void editor_setup(void)
+{
+	size_t len = 0;
+	int i;
+
+	bed = editor_create(NULL, NULL);
+	chunk = malloc(CHUNK_LINES * 80);
+	for (i = 0; i < CHUNK_LINES; i++)
+		len += sprintf(chunk + len, "%s\tsome_function(arg%d, %d);",
+				i ? "\n" : "", i, i * 3);
+}
+
+static void editor_teardown(void)
+{
+	editor_destroy(bed);
+	free(chunk);
+}
+
+static unsigned long run_addchunk(unsigned long n)
+{
+	unsigned long i;
+
+	n = (n + CHUNK_LINES - 1) / CHUNK_LINES;
+	for (i = 0; i < n; i++)
+		editor_addchunk(bed, (i * CHUNK_LINES) % 16384, 0, chunk, 0);
+
+	return n * CHUNK_LINES;
+}
+
+/* a 4MB document of 80 column lines */
+#define BIGDOC_SIZE (4 * 1024 * 1024)
+
+static void bigdoc_setup(void)
+{
+	char *doc;
+	int i;
+
+	doc = malloc(BIGDOC_SIZE);
+	for (i = 0; i < BIGDOC_SIZE; i++)
+		doc[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+
+	bed = editor_create(NULL, NULL);
+	editor_insert(bed, 0, doc, BIGDOC_SIZE);
+	free(doc);
+}
+
+static void bigdoc_teardown(void)
+{
+	editor_destroy(bed);
+}
+
+static unsigned long run_bigdoc_edit(unsigned long n)
+{
+	unsigned long i;
+	size_t off;
+
+	for (i = 0; i < n; i++) {
+		off = (i * 2654435761UL) % BIGDOC_SIZE;
+		editor_insert(bed, off, "x", 1);
+		editor_delete(bed, off, 1);
+	}
+
+	return n;
+}
+
+static unsigned long run_bigdoc_locate(unsigned long n)
+{
+	unsigned long i;
+	unsigned line, col;
+
+	for (i = 0; i < n; i++)
+		editor_locate(bed, (i * 2654435761UL) % BIGDOC_SIZE, &line,
+				&col);
+
+	return n;
+}
+
+static struct bench benches[] = {
+	{ "obby_escape_string",		escape_setup,	run_escape,
+		escape_teardown },
+	{ "obby_unescape_string",	escape_setup,	run_unescape,
+		escape_teardown },
+	{ "obbyuser_find_by_name/200",	sess_setup,	run_find_user,
+		sess_teardown },
+	{ "obbyuser_find/200",		sess_setup,	run_find_user_uid,
+		sess_teardown },
+	{ "obbydoc_find_by_name/1000",	sess_setup,	run_find_doc,
+		sess_teardown },
+	{ "obbydoc_find/1000",		sess_setup,	run_find_doc_id,
+		sess_teardown },
+	{ "parse_command(obby_message)", sess_setup,	run_parse_message,
+		sess_teardown },
+	{ "parse_inbuf(per command)",	stream_setup,	run_parse_inbuf,
+		stream_teardown },
+	{ "parse_inbuf(pull, per command)", stream_pull_setup,
+		run_parse_inbuf_pull, stream_teardown },
+	{ "editor_addchunk(per line)",	editor_setup,	run_addchunk,
+		editor_teardown },
+	{ "editor_insert+delete(4MB)",	bigdoc_setup,	run_bigdoc_edit,
+		bigdoc_teardown },
+	{ "editor_locate(4MB)",		bigdoc_setup,	run_bigdoc_locate,
+		bigdoc_teardown },
+};
+
+static void bench_run(struct bench *b, const char *filter)
+{
+	unsigned long long t0, t = 0, ops = 0;
+	unsigned long n = 1, allocs;
+
+	if (filter && !strstr(b->b_name, filter))
+		return;
+
+	if (b->b_setup)
+		b->b_setup();
+
+	/* warm up and find an iteration count that takes ~10ms */
+	for (;;) {
+		t0 = obby_clock_ns();
+		b->b_run(n);
+		if (obby_clock_ns() - t0 > BENCH_NS / 20 || n >= 1UL << 30)
+			break;
+		n *= 2;
+	}
+
+	allocs = nallocs;
+	while (t < BENCH_NS) {
+		t0 = obby_clock_ns();
+		ops += b->b_run(n);
+		t += obby_clock_ns() - t0;
+	}
+	allocs = nallocs - allocs;
+
+	printf("%-32s %12llu %10.1f ns/op %8.2f allocs/op\n", b->b_name, ops,
+			(double)t / ops, (double)allocs / ops);
+
+	if (b->b_teardown)
+		b->b_teardown();
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	printf("%-32s %12s %16s %18s\n", "benchmark", "ops", "time", "allocs");
+	for (i = 0; i < ARRSZ(benches); i++)
+		bench_run(&benches[i], argc > 1 ? argv[1] : NULL);
+
+	return 0;
+}
@@ -3,10 +3,17 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gnutls/gnutls.h>
 #include <stdarg.h>
 #include "cobby.h"
@@ -14,7 +21,7 @@
 #if 1
 #define diag(__os, __s, __a...) \
 	do { \
-		dbgfn(__os, "%s(): " __s, __FUNCTION__, ## __a); \
+		__obby_dbgout(__os, "%s(): " __s, __FUNCTION__, ## __a); \
 	} while (0);
 #else
 #define diag(__os, __s, __a...) do {} while (0)
@@ -26,16 +33,17 @@ static int __obbysess_create_client(const char *host, const char *port);
 static int parse_command(struct obbysess *os, char *cmd);
 static void parse_inbuf(struct obbysess *os);
 static void send_outbuf(struct obbysess *os);
-static struct obbyuser *obbyuser_create(struct obbysess *os, char *name,
+static struct obbyuser *obbyuser_create(struct obbysess *os, obbyatom_t name,
 		unsigned long net6uid, long color);
 static struct obbyuser *obbyuser_find(struct obbysess *os, unsigned long uid);
-static struct obbyuser *obbyuser_find_by_name(struct obbysess *os, char *name);
+static struct obbyuser *obbyuser_find_by_name(struct obbysess *os,
+		const char *name, size_t len);
 static struct obbyuser *obbyuser_find_by_nid(struct obbysess *os,
 		unsigned long nid);
 static void obbyuser_free(struct obbyuser *ou);
 static void obbysess_free_docs(struct obbysess *os);
 static void obbysess_free_users(struct obbysess *os);
-static struct obbydoc *obbydoc_create(struct obbysess *os, char *name,
+static struct obbydoc *obbydoc_create(struct obbysess *os, obbyatom_t name,
 		unsigned long obbyuid, unsigned long obbyuididx,
 		unsigned nusers);
 static struct obbydoc *obbydoc_find(struct obbysess *os, unsigned long oid,
@@ -43,24 +51,58 @@ static struct obbydoc *obbydoc_find(struct obbysess *os, unsigned long oid,
 static struct obbydoc *obbydoc_find_by_name(struct obbysess *os,
 		const char *docname);
 static void obbydoc_free(struct obbydoc *od);
-
-static void __dbgout(struct obbysess *os, const char *fmt, ...)
+static void obbystrtab_free(struct obbystrtab *st);
+static void __obbysess_login(struct obbysess *os);
+static void __obbysess_lost(struct obbysess *os);
+static void __obbysess_idle(struct obbytimer *t, void *priv);
+static void __obbysess_reconnect(struct obbytimer *t, void *priv);
+static void __obbysess_batch_expire(struct obbytimer *t, void *priv);
+static void __obbysess_upload_pump(struct obbysess *os);
+static void __obbysess_upload_free(struct obbysess *os);
+static void __obbysess_remember(struct obbysess *os, struct obbydoc *od);
+static int __obbysess_sockopts(struct obbysess *os);
+static int __obbysess_cork(struct obbysess *os, int on);
+
+/* longer debug messages are cut short */
+#define OBBY_DEBUG_MAX 512
+
+static void __obby_dbgout(struct obbysess *os, const char *fmt, ...)
 {
+	char msg[OBBY_DEBUG_MAX];
 	va_list args;
-	char *msg;
 
 	va_start(args, fmt);
-	if (!os || !os->os_notify_user || vasprintf(&msg, fmt, args) == -1)
-		fprintf(stderr, fmt, args);
+	if (!os)
+		vfprintf(stderr, fmt, args);
 	else {
+		vsnprintf(msg, sizeof(msg), fmt, args);
 		obbysess_notify(os, OETYPE_DEBUG_MESSAGE,
 				.oe_message = msg);
-		free(msg);
 	}
 	va_end(args);
 }
 
-static void (*dbgfn)(struct obbysess *, const char *, ...) = __dbgout;
+/* make *@buf, which is *@size bytes, at least @need bytes */
+static int __reserve(char **buf, size_t *size, size_t need)
+{
+	size_t n = *size ? *size : 64;
+	char *b;
+
+	if (need <= *size)
+		return 0;
+
+	while (n < need)
+		n *= 2;
+
+	b = realloc(*buf, n);
+	if (!b)
+		return -1;
+
+	*buf = b;
+	*size = n;
+
+	return 0;
+}
 
 struct obby_command {
 	const char *oc_string;
@@ -122,7 +164,8 @@ static int net6_encryption_handler(struct obbysess *os, char *args)
 	if (os->os_type == OSTYPE_CLIENT && p == 0) {
 		diag(os, "server requests encryption\n");
 
-		obbysess_enqueue_command(os, "net6_encryption_ok\n");
+		obbysess_enqueue_command(os, OBBY_PRIO_CONTROL,
+				"net6_encryption_ok\n");
 	} else if (os->os_type == OSTYPE_SERVER && p == 1) {
 		diag(os, "client requests encryption\n");
 	} else {
@@ -138,7 +181,7 @@ static ssize_t __send(struct obbysess *os, const void *data, size_t size)
 {
 	return os->os_flags & OSFLAG_ENCRYPTED
 			? gnutls_record_send(os->os_tlssess, data, size)
-			: write(os->os_sock, data, size);
+			: send(os->os_sock, data, size, MSG_NOSIGNAL);
 }
 
 static ssize_t __recv(struct obbysess *os, void *data, size_t size)
@@ -160,17 +203,15 @@ static ssize_t __recv(struct obbysess *os, void *data, size_t size)
 static int net6_encryption_begin_handler(struct obbysess *os, char *args)
 {
 	int n;
-	const int kx_prio[] = { GNUTLS_KX_ANON_DH, 0 };
 
 	if (os->os_type == OSTYPE_CLIENT) {
 		diag(os, "starting client tls session\n");
-		gnutls_global_init();
-
 		gnutls_anon_allocate_client_credentials(&os->os_anoncred);
 
 		gnutls_init(&os->os_tlssess, GNUTLS_CLIENT);
-		gnutls_set_default_priority(os->os_tlssess);
-		gnutls_kx_set_priority(os->os_tlssess, kx_prio);
+		/* obby only does anonymous DH */
+		gnutls_priority_set_direct(os->os_tlssess, "NORMAL:+ANON-DH",
+				NULL);
 		gnutls_credentials_set(os->os_tlssess, GNUTLS_CRD_ANON,
 				os->os_anoncred);
 		/*gnutls_session_set_ptr(os->os_tlssess, os);*/
@@ -192,6 +233,10 @@ static int net6_encryption_begin_handler(struct obbysess *os, char *args)
 		diag(os, "TLS handshake succeeded\n");
 		os->os_flags |= OSFLAG_ENCRYPTED;
 		os->os_state = OSSTATE_SHOOKHANDS;
+
+		/* log in right away if we know who we are */
+		if (os->os_nick)
+			__obbysess_login(os);
 	} else {
 		diag(os, "server encryption -- not implemented\n");
 		return -1;
@@ -211,7 +256,24 @@ static int net6_encryption_begin_handler(struct obbysess *os, char *args)
  */
 static int net6_ping_handler(struct obbysess *os, char *args)
 {
-	obbysess_enqueue_command(os, "net6_pong\n");
+	obbysess_enqueue_command(os, OBBY_PRIO_CONTROL, "net6_pong\n");
+	return 0;
+}
+
+/*
+ * -- proto command --
+ * net6_pong is the response to our net6_ping
+ * sender: [theoretically] both
+ * args: none
+ * no response expected
+ */
+static int net6_pong_handler(struct obbysess *os, char *args)
+{
+	if (os->os_ping_sent) {
+		os->os_stats.st_rtt_ns = obby_clock_ns() - os->os_ping_sent;
+		os->os_ping_sent = 0;
+	}
+
 	return 0;
 }
 
@@ -229,17 +291,150 @@ static int obby_sync_init_handler(struct obbysess *os, char *args)
 	unsigned long nitems;
 
 	os->os_state = OSSTATE_JOINED;
+	os->os_stats.st_sync_start = obby_clock_ns();
 
 	nitems = strtol(args, NULL, 16);
 	diag(os, "expecting %d users\n", nitems);
 
+	/* users who have joined already are in the table that follows */
 	os->os_nitems = nitems;
-	memset(&os->os_users, 0, sizeof(os->os_users));
 
 	return 0;
 }
 
-static struct obbyuser *obbyuser_create(struct obbysess *os, char *name,
+/*
+ * String table: FNV-1a hashed, open addressing with linear probing;
+ * the hash array is kept at most half full
+ */
+static unsigned long __strhash(const char *str, size_t len)
+{
+	unsigned long h = 2166136261UL;
+
+	while (len--) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+static obbyatom_t *__strtab_slot(struct obbystrtab *st, const char *str,
+		size_t len)
+{
+	unsigned long i;
+	obbyatom_t a;
+
+	i = __strhash(str, len) & (st->st_hsize - 1);
+	while ((a = st->st_hash[i]) != OBBYATOM_NONE) {
+		if (!strncmp(st->st_strs[a], str, len) && !st->st_strs[a][len])
+			break;
+
+		i = (i + 1) & (st->st_hsize - 1);
+	}
+
+	return &st->st_hash[i];
+}
+
+static int __strtab_grow(struct obbystrtab *st)
+{
+	obbyatom_t *hash, *oldhash = st->st_hash;
+	unsigned i, hsize = st->st_hsize ? st->st_hsize * 2 : 64;
+	unsigned oldhsize = st->st_hsize;
+	char **strs;
+
+	hash = calloc(hsize, sizeof(obbyatom_t));
+	if (!hash)
+		return -1;
+
+	strs = realloc(st->st_strs, hsize / 2 * sizeof(char *));
+	if (!strs) {
+		free(hash);
+		return -1;
+	}
+
+	if (!st->st_strs) {
+		/* atom 0 is reserved for OBBYATOM_NONE */
+		strs[0] = NULL;
+		st->st_nstrs = 1;
+	}
+
+	st->st_strs = strs;
+	st->st_size = hsize / 2;
+	st->st_hash = hash;
+	st->st_hsize = hsize;
+
+	for (i = 0; i < oldhsize; i++)
+		if (oldhash[i] != OBBYATOM_NONE) {
+			const char *str = st->st_strs[oldhash[i]];
+
+			*__strtab_slot(st, str, strlen(str)) = oldhash[i];
+		}
+
+	free(oldhash);
+
+	return 0;
+}
+
+static void obbystrtab_free(struct obbystrtab *st)
+{
+	unsigned i;
+
+	for (i = 1; i < st->st_nstrs; i++)
+		free(st->st_strs[i]);
+
+	free(st->st_strs);
+	free(st->st_hash);
+	memset(st, 0, sizeof(*st));
+}
+
+/*
+ * Find an atom for @len bytes of @str, OBBYATOM_NONE if it was never
+ * interned in this session
+ */
+obbyatom_t obby_atom_lookup(struct obbysess *os, const char *str, size_t len)
+{
+	if (!os->os_strtab.st_hsize)
+		return OBBYATOM_NONE;
+
+	return *__strtab_slot(&os->os_strtab, str, len);
+}
+
+/*
+ * Return an atom for @len bytes of @str, storing a copy of the string
+ * in the session's string table if it's not there yet
+ */
+obbyatom_t obby_intern(struct obbysess *os, const char *str, size_t len)
+{
+	struct obbystrtab *st = &os->os_strtab;
+	obbyatom_t *slot;
+	char *copy;
+
+	if (st->st_nstrs + 1 > st->st_size && __strtab_grow(st))
+		return OBBYATOM_NONE;
+
+	slot = __strtab_slot(st, str, len);
+	if (*slot != OBBYATOM_NONE)
+		return *slot;
+
+	copy = strndup(str, len);
+	if (!copy)
+		return OBBYATOM_NONE;
+
+	st->st_strs[st->st_nstrs] = copy;
+	*slot = st->st_nstrs;
+
+	return st->st_nstrs++;
+}
+
+const char *obby_atom_name(struct obbysess *os, obbyatom_t atom)
+{
+	if (atom == OBBYATOM_NONE || atom >= os->os_strtab.st_nstrs)
+		return NULL;
+
+	return os->os_strtab.st_strs[atom];
+}
+
+static struct obbyuser *obbyuser_create(struct obbysess *os, obbyatom_t name,
 		unsigned long net6uid, long color)
 {
 	struct obbyuser *ou;
@@ -250,7 +445,8 @@ static struct obbyuser *obbyuser_create(struct obbysess *os, char *name,
 		return NULL;
 	}
 
-	ou->ou_name = name;
+	ou->ou_atom = name;
+	ou->ou_name = (char *)obby_atom_name(os, name);
 	ou->ou_net6uid = net6uid;
 	ou->ou_color = color;
 	ou->ou_obbyuid = -1UL;
@@ -270,12 +466,18 @@ static struct obbyuser *obbyuser_find(struct obbysess *os, unsigned long uid)
 	return 0;
 }
 
-static struct obbyuser *obbyuser_find_by_name(struct obbysess *os, char *name)
+static struct obbyuser *obbyuser_find_by_name(struct obbysess *os,
+		const char *name, size_t len)
 {
+	obbyatom_t atom;
 	int i;
 
+	atom = obby_atom_lookup(os, name, len);
+	if (atom == OBBYATOM_NONE)
+		return 0;
+
 	for (i = 0; i < os->os_eusers; i++)
-		if (!strcmp(os->os_users[i]->ou_name, name))
+		if (os->os_users[i]->ou_atom == atom)
 			return os->os_users[i];
 
 	return 0;
@@ -295,7 +497,6 @@ static struct obbyuser *obbyuser_find_by_nid(struct obbysess *os,
 
 static void obbyuser_free(struct obbyuser *ou)
 {
-	free(ou->ou_name);
 	free(ou);
 }
 
@@ -311,7 +512,7 @@ static void obbysess_free_users(struct obbysess *os)
 	os->os_eusers = 0;
 }
 
-static struct obbydoc *obbydoc_create(struct obbysess *os, char *name,
+static struct obbydoc *obbydoc_create(struct obbysess *os, obbyatom_t name,
 		unsigned long obbyuid, unsigned long obbyuididx,
 		unsigned nusers)
 {
@@ -323,20 +524,23 @@ static struct obbydoc *obbydoc_create(struct obbysess *os, char *name,
 		return NULL;
 	}
 
-	od->od_name = name;
+	od->od_atom = name;
+	od->od_name = (char *)obby_atom_name(os, name);
 	od->od_obbyuid = obbyuid;
 	od->od_obbyuididx = obbyuididx;
 	od->od_nusers = nusers;
 	od->od_encoding = NULL;
+	od->od_conv = NULL;
+	od->od_charpos = 0;
+	od->od_npartial = 0;
+	od->od_local = 0;
+	od->od_remote = 0;
 
 	return od;
 }
 
 static void obbydoc_free(struct obbydoc *od)
 {
-	free(od->od_name);
-	if (od->od_encoding)
-		free(od->od_encoding);
 	free(od);
 }
 
@@ -370,10 +574,15 @@ static struct obbydoc *obbydoc_find(struct obbysess *os, unsigned long oid,
 static struct obbydoc *obbydoc_find_by_name(struct obbysess *os,
 		const char *docname)
 {
+	obbyatom_t atom;
 	int i;
 
+	atom = obby_atom_lookup(os, docname, strlen(docname));
+	if (atom == OBBYATOM_NONE)
+		return NULL;
+
 	for (i = 0; i < os->os_edocs; i++)
-		if (!strcmp(os->os_docs[i]->od_name, docname))
+		if (os->os_docs[i]->od_atom == atom)
 			return os->os_docs[i];
 
 	return NULL;
@@ -397,32 +606,34 @@ static struct obbydoc *obbydoc_find_by_name(struct obbysess *os,
 static int net6_client_join_handler(struct obbysess *os, char *args)
 {
 	struct obbyuser *ou;
-	char *color, *name;
 	unsigned long net6uid, oid, c;
-	int n, enc;
+	int n, enc, ns = 0, ne = 0;
 
 	/* XXX: older versions of protocol will pass fewer fields */
-	n = sscanf(args, "%lx:%a[^:]:%x:%lx:%as\n",
+	n = sscanf(args, "%lx:%n%*[^:]%n:%x:%lx:%lx\n",
 			&net6uid,
-			&name,
+			&ns, &ne,
 			&enc,
 			&oid,
-			&color);
-	if (n != 5) {
+			&c);
+	if (n != 4 || ne <= ns) {
 		err(os, "malformed join command: %d, %s\n", n, args);
 		os->os_state = OSSTATE_ERROR;
 		return -1;
 	}
 
-	c = strtoul(color, NULL, 16);
-	free(color);
-
-	ou = obbyuser_find_by_name(os, name);
+	/* rejoining users are looked up without copying their names */
+	ou = obbyuser_find_by_name(os, args + ns, ne - ns);
 	if (ou) {
 		ou->ou_net6uid = net6uid;
-
-		free(name);
 	} else {
+		obbyatom_t name = obby_intern(os, args + ns, ne - ns);
+
+		if (name == OBBYATOM_NONE) {
+			os->os_state = OSSTATE_ERROR;
+			return -1;
+		}
+
 		ou = obbyuser_create(os, name, net6uid, c);
 		if (!ou) {
 			os->os_state = OSSTATE_ERROR;
@@ -503,22 +714,32 @@ static int net6_client_part_handler(struct obbysess *os, char *args)
 static int obby_sync_usertable_user_handler(struct obbysess *os, char *args)
 {
 	struct obbyuser *ou;
-	char *color, *name;
+	obbyatom_t name;
 	unsigned long net6uid, c;
-	int n;
+	int n, ns = 0, ne = 0;
 
-	n = sscanf(args, "%lx:%a[^:]:%as\n",
+	n = sscanf(args, "%lx:%n%*[^:]%n:%lx\n",
 			&net6uid,
-			&name,
-			&color);
-	if (n != 3) {
+			&ns, &ne,
+			&c);
+	if (n != 2 || ne <= ns) {
 		err(os, "malformed sync command: %d, %s\n", n, args);
 		os->os_state = OSSTATE_ERROR;
 		return -1;
 	}
 
-	c = strtoul(color, NULL, 16);
-	free(color);
+	ou = obbyuser_find_by_name(os, args + ns, ne - ns);
+	if (ou) {
+		obbysess_notify(os, OETYPE_USER_KNOWN,
+				.oe_username = ou->ou_name);
+		return 0;
+	}
+
+	name = obby_intern(os, args + ns, ne - ns);
+	if (name == OBBYATOM_NONE) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
 
 	ou = obbyuser_create(os, name, net6uid, c);
 	if (!ou) {
@@ -552,30 +773,40 @@ static int obby_sync_doclist_document_handler(struct obbysess *os, char *args)
 {
 	struct obbydoc *od;
 	unsigned obbyuid, obbyuididx, nusers;
-	char *name, *enc;
-	int n;
+	obbyatom_t name, enc;
+	int n, ns = 0, ne = 0, es = 0;
 
 	/* XXX: older versions of protocol will pass fewer fields */
-	n = sscanf(args, "%x:%x:%a[^:]:%x:%as\n",
+	n = sscanf(args, "%x:%x:%n%*[^:]%n:%x:%n",
 			&obbyuid,
 			&obbyuididx,
-			&name,
+			&ns, &ne,
 			&nusers,
-			&enc);
-	if (n != 5) {
+			&es);
+	if (n != 3 || ne <= ns || !es || !args[es]) {
 		err(os, "malformed sync command: %d, %s\n", n, args);
 		os->os_state = OSSTATE_ERROR;
 		return -1;
 	}
 
+	name = obby_intern(os, args + ns, ne - ns);
+	enc = obby_intern(os, args + es, strcspn(args + es, ":\n"));
+	if (name == OBBYATOM_NONE || enc == OBBYATOM_NONE) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
+
 	od = obbydoc_create(os, name, obbyuid, obbyuididx, nusers);
 	if (!od) {
 		os->os_state = OSSTATE_ERROR;
 		return -1;
 	}
 
-	od->od_encoding = enc;
 	os->os_docs[os->os_edocs++] = od;
+	if (obbydoc_set_encoding(os, od, enc)) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
 
 	obbysess_notify(os, OETYPE_DOC_KNOWN, .oe_docname = od->od_name);
 
@@ -596,9 +827,24 @@ static int obby_sync_doclist_document_handler(struct obbysess *os, char *args)
  */
 static int obby_document_create_handler(struct obbysess *os, char *args)
 {
+	struct obbyupload *up = os->os_upload;
+	struct obbydoc *od;
+
 	/* XXX: the effect is identical, thought we should doublecheck that
 	 * the document isn't yet registered within us */
-	return obby_sync_doclist_document_handler(os, args);
+	if (obby_sync_doclist_document_handler(os, args))
+		return -1;
+
+	/* the one we're uploading: its creator has it open from the start */
+	od = os->os_docs[os->os_edocs - 1];
+	if (up && !up->up_doc && od->od_atom == up->up_name &&
+			od->od_obbyuid == up->up_uid &&
+			od->od_obbyuididx == up->up_idx) {
+		up->up_doc = od;
+		__obbysess_remember(os, od);
+	}
+
+	return 0;
 }
 
 /*
@@ -610,6 +856,8 @@ static int obby_document_create_handler(struct obbysess *os, char *args)
  */
 static int obby_sync_final_handler(struct obbysess *os, char *args)
 {
+	int i;
+
 	if (os->os_nitems != os->os_eusers + os->os_edocs) {
 		err(os, "invalid number of items given: %d, "
 				"received: %d\n", os->os_nitems,
@@ -620,6 +868,19 @@ static int obby_sync_final_handler(struct obbysess *os, char *args)
 
 	os->os_state = OSSTATE_SYNCED;
 	os->os_nitems = 0;
+	os->os_stats.st_sync_ns = obby_clock_ns() - os->os_stats.st_sync_start;
+	os->os_retries = 0;
+
+	/* after a reconnect, get back the documents we had open */
+	for (i = 0; i < os->os_nsubs; i++) {
+		struct obbydoc *od = obbydoc_find_by_name(os,
+				obby_atom_name(os, os->os_subs[i]));
+
+		if (od)
+			obbysess_enqueue_command(os, OBBY_PRIO_BULK,
+					"obby_document:%lx %lx:subscribe:0\n",
+					od->od_obbyuid, od->od_obbyuididx);
+	}
 
 	return 0;
 }
@@ -656,6 +917,7 @@ static int obby_message_handler(struct obbysess *os, char *args)
 	}
 
 	p++;
+	obby_unescape(p);
 
 	obbysess_notify(os, OETYPE_CHAT_MESSAGE,
 			.oe_username = ou->ou_name,
@@ -677,6 +939,7 @@ static int __obby_document_sync_init(struct obbysess *os, unsigned long oid,
 
 	len = strtol(args, NULL, 16);
 	diag(os, "expecting document %d bytes long\n", len);
+	obbydoc_convert_reset(od);
 
 	obbysess_notify(os, OETYPE_DOC_OPEN,
 			.oe_docname = od->od_name,
@@ -686,10 +949,35 @@ static int __obby_document_sync_init(struct obbysess *os, unsigned long oid,
 	return 0;
 }
 
+/*
+ * Text for a document as the UI gets it: converted to UTF-8 if the
+ * document is in some other encoding (@more if it continues in the next
+ * sync chunk), checked and fixed up in place if it's UTF-8 already; bad
+ * bytes are replaced, not dropped, so positions in the document stay
+ * the same. NULL if out of memory.
+ */
+static char *obbydoc_text(struct obbysess *os, struct obbydoc *od,
+		char *text, int more)
+{
+	size_t bad;
+
+	if (od->od_conv)
+		return obbydoc_convert(os, od, text, strlen(text), more);
+
+	bad = obby_utf8_scrub(text, strlen(text));
+	if (bad) {
+		err(os, "%lu bytes of invalid UTF-8 in %s\n",
+				(unsigned long)bad, od->od_name);
+		os->os_stats.st_bad_utf8 += bad;
+	}
+
+	return text;
+}
+
 static int __obby_document_sync_chunk(struct obbysess *os, unsigned long oid,
 		unsigned long oididx, char *args)
 {
-	char *p = strrchr(args, ':');
+	char *p = strrchr(args, ':'), *text;
 	struct obbydoc *od;
 
 	if (!p) {
@@ -705,55 +993,258 @@ static int __obby_document_sync_chunk(struct obbysess *os, unsigned long oid,
 	/* the number that follows should mean something. probably. */
 	*p++ = 0;
 
+	obby_unescape(args);
+	text = obbydoc_text(os, od, args, 1);
+	if (!text) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
+
 	obbysess_notify(os, OETYPE_DOC_GETCHUNK,
 			.oe_docname = od->od_name,
-			.oe_message = obby_unescape_string(args, -1)
+			.oe_message = text
 			);
 
 	return 0;
 }
 
+/*
+ * Sync chunks can be a document's entire text in one line, and one that
+ * is too long to be waited for is passed on as it comes, in as many
+ * DOC_GETCHUNK events as it takes: once the line starts with a sync
+ * chunk for a document we know, everything up to the first colon is
+ * text (colons in it are escaped), and whatever follows it up to the
+ * newline is dropped.
+ */
+static int __obby_document_stream_start(struct obbysess *os, char **line)
+{
+	unsigned long oid, oididx;
+	struct obbydoc *od;
+	int n = 0;
+
+	if (strncmp(*line, "obby_document:", 14) ||
+			sscanf(*line + 14, "%lx %lx:sync_chunk:%n", &oid,
+				&oididx, &n) != 2 || !n)
+		return 0;
+
+	od = obbydoc_find(os, oid, oididx);
+	if (!od)
+		return 0;
+
+	diag(os, "streaming a sync chunk for %s\n", od->od_name);
+	os->os_stats.st_streamed++;
+	os->os_instream = od;
+	os->os_inskip = 0;
+	*line += 14 + n;
+
+	return 1;
+}
+
+/*
+ * Where to cut [@p, @end), the chunk so far, not to split an escape, or
+ * a character (which a converted document keeps for the next piece)
+ */
+static char *__obby_document_stream_cut(struct obbydoc *od, char *p,
+		char *end)
+{
+	char *q = end, *b;
+	unsigned char lead;
+
+	/* escapes are two bytes, a backslash and a letter */
+	if (q > p && q[-1] == '\\')
+		q--;
+
+	if (od->od_conv)
+		return q;
+
+	for (b = q; b > p && q - b < 3 && (b[-1] & 0xc0) == 0x80; b--)
+		;
+	if (b > p && (b[-1] & 0xc0) == 0xc0) {
+		lead = b[-1];
+		if (q - b + 1 < (lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2))
+			q = b - 1;
+	}
+
+	return q;
+}
+
+/*
+ * Pass on what there is of the chunk being streamed in [@p, @end);
+ * returns where parsing goes on from
+ */
+static char *__obby_document_stream(struct obbysess *os, char *p, char *end)
+{
+	struct obbydoc *od = os->os_instream;
+	char *nl = memchr(p, '\n', end - p);
+	char *q, *text, c;
+
+	if (!os->os_inskip) {
+		q = memchr(p, ':', (nl ? nl : end) - p);
+		if (q)
+			os->os_inskip = 1;
+		else if (nl)
+			q = nl;
+		else
+			q = __obby_document_stream_cut(od, p, end);
+
+		c = *q;
+		*q = 0;
+		obby_unescape(p);
+		text = obbydoc_text(os, od, p, 1);
+		*q = c;
+		if (!text) {
+			os->os_state = OSSTATE_ERROR;
+			return end;
+		}
+
+		if (*text)
+			obbysess_notify(os, OETYPE_DOC_GETCHUNK,
+					.oe_docname = od->od_name,
+					.oe_message = text
+					);
+
+		/* the rest of it is yet to come */
+		if (!os->os_inskip && !nl)
+			return q;
+	}
+
+	if (!nl)
+		return end;
+
+	os->os_instream = NULL;
+	os->os_inskip = 0;
+
+	return nl + 1;
+}
+
+/*
+ * A record is an operation on the document by one of the users:
+ *  + obby user id of the author;
+ *  + jupiter time: author's local operation count;
+ *  + jupiter time: author's remote operation count;
+ *  + operation: "ins" followed by position and text, "del" followed
+ *    by position and length, or "noop"
+ */
+static int __obby_document_record(struct obbysess *os, unsigned long oid,
+		unsigned long oididx, char *args)
+{
+	unsigned long author, local, remote, pos, len;
+	struct obbydoc *od;
+	struct obbyuser *ou;
+	char op[5], *text;
+	int n, ts = 0;
+
+	od = obbydoc_find(os, oid, oididx);
+	if (!od)
+		return -1;
+
+	if (os->os_batch.ob_doc == od)
+		obbysess_flush_edits(os);
+
+	n = sscanf(args, "%lx:%lx:%lx:%4[a-z]:%lx:%n",
+			&author,
+			&local,
+			&remote,
+			op,
+			&pos,
+			&ts);
+	if (n == 4 && !strcmp(op, "noop")) {
+		od->od_remote++;
+		return 0;
+	}
+
+	if (n != 5 || !ts) {
+		err(os, "malformed record: %d, %s\n", n, args);
+		return -1;
+	}
+
+	od->od_remote++;
+	ou = obbyuser_find(os, author);
+
+	/*
+	 * XXX: operations are applied as they come; local operations that
+	 * the server hasn't seen yet are not transformed against them
+	 *
+	 * XXX: in a multibyte encoding other than UTF-8, positions are
+	 * offsets into text we no longer have and are passed on as they are
+	 */
+	if (!strcmp(op, "ins")) {
+		obby_unescape(args + ts);
+		text = obbydoc_text(os, od, args + ts, 0);
+		if (!text) {
+			os->os_state = OSSTATE_ERROR;
+			return -1;
+		}
+
+		obbysess_notify(os, OETYPE_DOC_INSERT,
+				.oe_docname = od->od_name,
+				.oe_username = ou ? ou->ou_name : NULL,
+				.oe_message = text,
+				.oe_pos = pos,
+				.oe_length = strlen(text),
+				.oe_flags = od->od_charpos ? OEFLAG_CHARS : 0
+				);
+	} else if (!strcmp(op, "del")) {
+		len = strtoul(args + ts, NULL, 16);
+		obbysess_notify(os, OETYPE_DOC_DELETE,
+				.oe_docname = od->od_name,
+				.oe_username = ou ? ou->ou_name : NULL,
+				.oe_pos = pos,
+				.oe_length = len,
+				.oe_flags = od->od_charpos ? OEFLAG_CHARS : 0
+				);
+	} else {
+		diag(os, "unknown operation %s\n", op);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int obby_document_handler(struct obbysess *os, char *args)
 {
 	char *p, *what;
 	unsigned long obbyuid, obbyuididx;
-	int n;
+	int n, ws = 0, we = 0;
 
-	n = sscanf(args, "%lx %lx:%a[^:]:%a[^\n]\n",
+	n = sscanf(args, "%lx %lx:%n%*[^:]%n",
 			&obbyuid,
 			&obbyuididx,
-			&what,
-			&p);
-	if (n != 4) {
+			&ws, &we);
+	if (n != 2 || we <= ws || args[we] != ':') {
 		err(os, "malformed obby_document command: %d, %s\n", n, args);
 		os->os_state = OSSTATE_ERROR;
 		return -1;
 	}
 
+	what = args + ws;
+	args[we] = 0;
+	p = args + we + 1;
+
 	diag(os, "got %s for [%lx:%lx]: %s\n", what, obbyuid, obbyuididx, p);
 	if (!strcmp(what, "sync_init")) {
 		__obby_document_sync_init(os, obbyuid, obbyuididx, p);
 	} else if (!strcmp(what, "sync_chunk")) {
 		__obby_document_sync_chunk(os, obbyuid, obbyuididx, p);
+	} else if (!strcmp(what, "record")) {
+		__obby_document_record(os, obbyuid, obbyuididx, p);
 	} else {
 		diag(os, "%s is not implemented\n", what);
 	}
 
-	free(what);
-	free(p);
-
 	return 0;
 }
 
 #define OBBY_CMD(__s) \
 	{ .oc_string = # __s, .oc_handler = __s ## _handler }
 
-static struct obby_command cmdlist[] = {
+static const struct obby_command cmdlist[] = {
 	OBBY_CMD(obby_welcome),
 	OBBY_CMD(net6_encryption),
 	OBBY_CMD(net6_encryption_begin),
 	OBBY_CMD(net6_login_failed),
 	OBBY_CMD(net6_ping),
+	OBBY_CMD(net6_pong),
 	OBBY_CMD(obby_sync_init),
 	OBBY_CMD(net6_client_join),
 	OBBY_CMD(net6_client_part),
@@ -794,17 +1285,31 @@ static int __obbysess_create_client(const char *host, const char *port)
 		close(sfd);
 	}
 
+	freeaddrinfo(result);
 	if (!rp)
 		return -1;
 
-	freeaddrinfo(result);
-
 	flags = fcntl(sfd, F_GETFL);
 	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
 
 	return sfd;
 }
 
+/*
+ * Set up (and tear down) what the library needs from gnutls; call once
+ * per process, before the first session is created and after the last
+ * one is gone
+ */
+int obby_init(void)
+{
+	return gnutls_global_init() < 0 ? -1 : 0;
+}
+
+void obby_fini(void)
+{
+	gnutls_global_deinit();
+}
+
 struct obbysess *obbysess_create(const char *host, const char *port,
 		int type)
 {
@@ -820,32 +1325,86 @@ struct obbysess *obbysess_create(const char *host, const char *port,
 		return NULL;
 
 	os = malloc(sizeof(struct obbysess));
-	if (!os)
+	if (!os) {
+		close(sock);
 		return NULL;
+	}
+
+	os->os_host = strdup(host);
+	os->os_port = strdup(port);
+	if (!os->os_host || !os->os_port) {
+		free(os->os_host);
+		free(os->os_port);
+		free(os);
+		close(sock);
+		return NULL;
+	}
 
 	os->os_flags = 0;
 	os->os_state = OSSTATE_OPEN;
 	os->os_type = type;
 	os->os_sock = sock;
 	os->os_inbuf = NULL;
-	os->os_outbuf = NULL;
+	os->os_inlen = 0;
+	os->os_insize = 0;
+	os->os_inmax = OBBY_INBUF_MAX;
+	os->os_instream = NULL;
+	os->os_inskip = 0;
+	memset(&os->os_outq, 0, sizeof(os->os_outq));
+	os->os_outcur = -1;
+	os->os_outretry = 0;
+	os->os_outmax = OBBY_OUTQ_MAX;
 	os->os_nitems = 0;
 	os->os_eusers = 0;
 	memset(&os->os_users, 0, sizeof(os->os_users));
 	os->os_edocs = 0;
 	memset(&os->os_docs, 0, sizeof(os->os_docs));
+	memset(&os->os_strtab, 0, sizeof(os->os_strtab));
+	memset(&os->os_stats, 0, sizeof(os->os_stats));
+	os->os_timing = NULL;
+	obbysess_default_sockopts(&os->os_sockopts);
+	__obbysess_sockopts(os);
+
+	os->os_nick = NULL;
+	os->os_color = NULL;
+	os->os_subs = NULL;
+	os->os_nsubs = 0;
+	os->os_wheel = NULL;
+	obbytimer_init(&os->os_idle_timer, __obbysess_idle, os);
+	obbytimer_init(&os->os_reconnect_timer, __obbysess_reconnect, os);
+	os->os_last_rx = obby_clock_ms();
+	os->os_ping_sent = 0;
+	os->os_ping_ms = OBBY_PING_MS;
+	os->os_dead_ms = OBBY_DEAD_MS;
+	os->os_retries = 0;
+	os->os_seed = obby_clock_ns() ^ sock;
+
+	os->os_convs = NULL;
+	os->os_convbuf = NULL;
+	os->os_convsize = 0;
+
+	memset(&os->os_batch, 0, sizeof(os->os_batch));
+	obbytimer_init(&os->os_batch.ob_timer, __obbysess_batch_expire, os);
+	os->os_upload = NULL;
 
 	os->os_notify_user = NULL;
+	os->os_evq = NULL;
+	os->os_nevq = os->os_evqhead = os->os_evqsize = 0;
+	os->os_evbuf = os->os_evcur = NULL;
+	os->os_evlen = os->os_evsize = os->os_evcursize = 0;
 
 	return os;
 }
 
 #define ARRSZ(__a) (sizeof(__a)/sizeof(*__a))
 
+/* fails to compile if cmdlist outgrows the counters in obbystats */
+typedef char __cmdlist_fits[ARRSZ(cmdlist) <= OBBY_MAX_CMDS ? 1 : -1];
+
 static int parse_command(struct obbysess *os, char *cmd)
 {
 	char *p = cmd, *q;
-	int i;
+	int i, ret;
 
 	diag(os, "got command: '%s'\n", cmd);
 	q = strchr(p, ':');
@@ -856,60 +1415,155 @@ static int parse_command(struct obbysess *os, char *cmd)
 		if (
 			!strncmp(p, cmdlist[i].oc_string, q - p) &&
 			q - p == strlen(cmdlist[i].oc_string)
-		   )
-			return cmdlist[i].oc_handler(os, q + 1);
+		   ) {
+			struct obbytiming *ot = os->os_timing;
+			unsigned long long t0 = ot ? obby_clock_ns() : 0, t1;
+
+			os->os_stats.st_cmds[i]++;
+			ret = cmdlist[i].oc_handler(os, *q ? q + 1 : q);
+			if (ret < 0)
+				os->os_stats.st_parse_errors++;
+
+			if (ot) {
+				t1 = obby_clock_ns();
+				obbyhist_record(&ot->ot_cmds[i], t1 - t0);
+				if (ot->ot_trace)
+					obbytrace_span(ot->ot_trace,
+							cmdlist[i].oc_string,
+							"cmd", ot->ot_tid,
+							t0, t1);
+			}
+
+			return ret;
+		}
+
+	os->os_stats.st_unknown_cmds++;
 
 	return -1;
 }
 
+/*
+ * Run every complete command in the input buffer, in place, and move
+ * whatever is left of an incomplete one to the front of it
+ */
 static void parse_inbuf(struct obbysess *os)
 {
-	char *p = os->os_inbuf;
-	char *q;
-	char *cmd;
-	int n;
+	char *p = os->os_inbuf, *q, *end;
 
-	if (!os->os_inbuf)
+	if (!os->os_inlen)
 		return;
 
-	q = strchr(os->os_inbuf, '\n');
-	while (q) {
-		cmd = malloc(q - p + 1);
-		if (!cmd) {
-			os->os_state = OSSTATE_ERROR;
-			return;
+	end = os->os_inbuf + os->os_inlen;
+	while (p < end && OS_ISOK(os)) {
+		if (os->os_instream) {
+			p = __obby_document_stream(os, p, end);
+			if (os->os_instream)
+				break;
+			continue;
 		}
 
-		memcpy(cmd, p, q - p);
-		cmd[q - p] = 0;
+		q = memchr(p, '\n', end - p);
+		if (!q) {
+			/* a sync chunk too long to wait for the end of */
+			if (end - p >= OBBY_STREAM_MIN &&
+					__obby_document_stream_start(os, &p))
+				continue;
+			break;
+		}
 
-		n = parse_command(os, cmd);
+		*q = 0;
 		/* don't fail on unknown commands */
-#if 0
-		if (n < 0) {
-			os->os_state = OSSTATE_ERROR;
-			return;
-		}
-#endif
+		parse_command(os, p);
 
 		p = q + 1;
-		q = strchr(p, '\n');
 	}
 
-	cmd = *p ? strdup(p) : NULL;
+	os->os_inlen = end - p;
+	memmove(os->os_inbuf, p, os->os_inlen);
+	os->os_inbuf[os->os_inlen] = 0;
+}
 
-	free(os->os_inbuf);
-	os->os_inbuf = cmd;
+/* the queue to send from next, -1 if there's nothing to send */
+static int __outq_next(struct obbysess *os)
+{
+	int prio;
+
+	/* once started, a command is sent whole before anything else */
+	if (os->os_outcur != -1)
+		return os->os_outcur;
+
+	for (prio = 0; prio < OBBY_PRIO_NR; prio++)
+		if (os->os_outq[prio].oq_tail)
+			return prio;
+
+	return -1;
 }
 
+static void __outq_reset(struct obbysess *os)
+{
+	int prio;
+
+	for (prio = 0; prio < OBBY_PRIO_NR; prio++)
+		os->os_outq[prio].oq_head = os->os_outq[prio].oq_tail = 0;
+
+	os->os_outcur = -1;
+	os->os_outretry = 0;
+}
+
+/*
+ * Send as much as the socket takes, the most urgent first; a queue is
+ * sent in one go, but one that's only got partly through gets to finish
+ * its current command and no more before the others are looked at again
+ */
 static void send_outbuf(struct obbysess *os)
 {
-	if (!os->os_outbuf)
-		return;
+	struct obbyoutq *oq;
+	size_t len;
+	ssize_t n;
+	char *p;
+	int prio;
+
+	while ((prio = __outq_next(os)) != -1) {
+		oq = &os->os_outq[prio];
+		p = oq->oq_buf + oq->oq_head;
+		len = oq->oq_tail - oq->oq_head;
+
+		/* TLS has to be offered the same again after E_AGAIN */
+		if (os->os_outretry)
+			len = os->os_outretry;
+		else if (os->os_outcur != -1)
+			len = (char *)memchr(p, '\n', len) - p + 1;
+
+		n = __send(os, p, len);
+		if (n <= 0) {
+			if (n < 0 && (os->os_flags & OSFLAG_ENCRYPTED)) {
+				if (gnutls_error_is_fatal(n))
+					break;
+				os->os_outcur = prio;
+				os->os_outretry = len;
+				return;
+			}
+
+			/* the socket is full, or gone */
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+			break;
+		}
+
+		os->os_outretry = 0;
+		os->os_stats.st_bytes_out += n;
+		oq->oq_head += n;
+		os->os_outcur = oq->oq_buf[oq->oq_head - 1] != '\n' ? prio : -1;
+		if (oq->oq_head == oq->oq_tail)
+			oq->oq_head = oq->oq_tail = 0;
+
+		if (n < len)
+			return;
+	}
 
-	__send(os, os->os_outbuf, strlen(os->os_outbuf));
-	free(os->os_outbuf);
-	os->os_outbuf = NULL;
+	/* the connection is lost; receiving will find out */
+	if (prio != -1)
+		__outq_reset(os);
 }
 
 /*
@@ -948,11 +1602,11 @@ char *obby_escape_string(const char *input, int replace)
 		return NULL;
 
 	*output = 0;
-	while ((p = __firstof(s, "\\:")) != NULL) {
+	while ((p = __firstof(s, "\\:\n")) != NULL) {
 		i += p - s;
 		strncat(output, s, i);
 		output[i++] = '\\';
-		output[i++] = *p == '\\' ? 'b' : 'd';
+		output[i++] = *p == '\\' ? 'b' : *p == ':' ? 'd' : 'n';
 		output[i] = 0;
 		s = p + 1;
 	}
@@ -966,103 +1620,161 @@ char *obby_escape_string(const char *input, int replace)
 	return output;
 }
 
+/*
+ * Undo obby_escape_string() on @str in place, which the decoded string
+ * always fits in; returns its new length
+ */
+size_t obby_unescape(char *str)
+{
+	char *d, *s;
+
+	d = s = strchr(str, '\\');
+	if (!s)
+		return strlen(str);
+
+	while (*s) {
+		if (*s != '\\')
+			*d++ = *s++;
+		else if (s[1] == 'd' || s[1] == 'b' || s[1] == 'n') {
+			*d++ = s[1] == 'd' ? ':' : s[1] == 'b' ? '\\' : '\n';
+			s += 2;
+		} else
+			*d++ = *s++;
+	}
+
+	*d = 0;
+
+	return d - str;
+}
+
 /*
  * replace == -1 will stand for 'inplace'
  */
 char *obby_unescape_string(const char *input, int replace)
 {
 	char *output;
-	const char *p, *s = input;
-	int i = 0;
 
-	/* to not realloc() needlessly */
-	output = malloc(strlen(input) + 1);
+	if (replace == -1) {
+		obby_unescape((char *)input);
+		return (char *)input;
+	}
+
+	output = strdup(input);
 	if (!output)
 		return NULL;
 
-	*output = 0;
-	while ((p = strchr(s, '\\')) != NULL) {
-		p++;
+	obby_unescape(output);
+	if (replace)
+		free((char *)input);
 
-		if (p != __firstof(p, "dbn")) {
-			s++;
-			continue;
-		}
+	return output;
+}
 
-		i += p - s - 1;
-		strncat(output, s, i);
-		switch (*p) {
-			case 'd':
-				output[i++] = ':';
-				break;
+static int __obbysess_vqueue(struct obbysess *os, int prio, int force,
+		const char *fmt, va_list args)
+{
+	struct obbyoutq *oq = &os->os_outq[prio];
+	va_list copy;
+	int n;
 
-			case 'b':
-				output[i++] = '\\';
-				break;
+	/* nothing overtakes an edit that's held back */
+	if (os->os_batch.ob_doc)
+		obbysess_flush_edits(os);
 
-			case 'n':
-				output[i++] = '\n';
-				break;
+	va_copy(copy, args);
+	n = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
 
-			default:
-				break;
-		}
+	if (n < 0) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
 
-		output[i] = 0;
-		s = ++p;
+	/* one that's over the limit on its own goes, once the rest has */
+	if (prio != OBBY_PRIO_CONTROL && !force && obbysess_outq(os) &&
+			obbysess_outq(os) + n > os->os_outmax) {
+		os->os_stats.st_outq_full++;
+		errno = EAGAIN;
+		return -1;
 	}
 
-	if (*s)
-		strcat(output, s);
+	/* what's been sent makes room, unless that's half the queue or less */
+	if (oq->oq_head && oq->oq_head >= oq->oq_tail - oq->oq_head) {
+		memmove(oq->oq_buf, oq->oq_buf + oq->oq_head,
+				oq->oq_tail - oq->oq_head);
+		oq->oq_tail -= oq->oq_head;
+		oq->oq_head = 0;
+	}
 
-	switch (replace) {
-		case -1:
-			strcpy((char *)input, output);
-			free(output);
-			return (char *)input;
+	if (__reserve(&oq->oq_buf, &oq->oq_size, oq->oq_tail + n + 1)) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
 
-		case 0:
-			break;
+	vsnprintf(oq->oq_buf + oq->oq_tail, n + 1, fmt, args);
+	diag(os, "queued: '%s'\n", oq->oq_buf + oq->oq_tail);
+	oq->oq_tail += n;
 
-		default:
-			free((char *)input);
-	}
+	if (obbysess_outq(os) > os->os_stats.st_outq_peak)
+		os->os_stats.st_outq_peak = obbysess_outq(os);
 
-	return output;
+	return 0;
 }
 
-void obbysess_enqueue_command(struct obbysess *os, const char *fmt, ...)
+/*
+ * Queue a command with priority @prio (OBBY_PRIO_*); returns -1 with
+ * errno set to EAGAIN if that would take the queues over the session's
+ * limit, in which case it's up to the caller to try again later
+ */
+int obbysess_enqueue_command(struct obbysess *os, int prio,
+		const char *fmt, ...)
 {
 	va_list args;
-	char *buf, *cmd;
-	int n;
+	int ret;
 
 	va_start(args, fmt);
-	n = vasprintf(&cmd, fmt, args);
+	ret = __obbysess_vqueue(os, prio, 0, fmt, args);
 	va_end(args);
 
-	if (n < 0) {
-		os->os_state = OSSTATE_ERROR;
+	return ret;
+}
+
+/* the same, for what can't be refused without breaking the protocol */
+static void __obbysess_queue(struct obbysess *os, int prio,
+		const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	__obbysess_vqueue(os, prio, 1, fmt, args);
+	va_end(args);
+}
+
+static void __obbysess_do(struct obbysess *os);
+
+void obbysess_do(struct obbysess *os)
+{
+	struct obbytiming *ot = os->os_timing;
+	unsigned long long t0, t1;
+
+	if (!ot) {
+		__obbysess_do(os);
 		return;
 	}
 
-	if (os->os_outbuf) {
-		buf = malloc(strlen(os->os_outbuf) + n);
-		strcpy(buf, os->os_outbuf);
-		strcat(buf, cmd);
-		free(os->os_outbuf);
-		free(cmd);
-		os->os_outbuf = buf;
-	} else
-		os->os_outbuf = cmd;
+	t0 = obby_clock_ns();
+	__obbysess_do(os);
+	t1 = obby_clock_ns();
 
-	diag(os, "outbuf: '%s'\n", os->os_outbuf);
+	obbyhist_record(&ot->ot_do, t1 - t0);
+	if (ot->ot_trace)
+		obbytrace_span(ot->ot_trace, "obbysess_do", "io", ot->ot_tid,
+				t0, t1);
 }
 
-void obbysess_do(struct obbysess *os)
+static void __obbysess_do(struct obbysess *os)
 {
-	char *buf = NULL;
-	int len = 0;
+	int s, corked;
 
 	switch (os->os_state) {
 		default:
@@ -1077,6 +1789,9 @@ void obbysess_do(struct obbysess *os)
 			diag(os, "session at fault\n");
 			return;
 
+		case OSSTATE_RECONNECT:
+			return;
+
 		case OSSTATE_SYNCED:
 		case OSSTATE_JOINED:
 		case OSSTATE_SHOOKHANDS:
@@ -1084,87 +1799,1120 @@ void obbysess_do(struct obbysess *os)
 			break;
 	}
 
-	if (os->os_inbuf) {
-		buf = strdup(os->os_inbuf);
-		if (!buf) {
-			os->os_state = OSSTATE_ERROR;
-			return;
+	/* with nothing to time them out, edits are held back until now */
+	if (!os->os_wheel)
+		obbysess_flush_edits(os);
+
+	for (;;) {
+		/* make room by parsing what's there, if it comes to that */
+		if (os->os_inlen + BUFSIZ + 1 > os->os_inmax) {
+			parse_inbuf(os);
+			if (!OS_ISOK(os))
+				return;
 		}
 
-		len = strlen(buf);
-	}
+		if (os->os_inlen + BUFSIZ + 1 > os->os_inmax) {
+			err(os, "no end to a line after %lu bytes\n",
+					(unsigned long)os->os_inlen);
+			os->os_stats.st_parse_errors++;
+			__obbysess_lost(os);
+			return;
+		}
 
-	for (;;) {
-		int s;
-		buf = realloc(buf, len + BUFSIZ);
-		if (!buf) {
+		if (__reserve(&os->os_inbuf, &os->os_insize,
+					os->os_inlen + BUFSIZ + 1)) {
 			os->os_state = OSSTATE_ERROR;
 			return;
 		}
 
-		s = __recv(os, buf + len, BUFSIZ);
-		if (s < 0) {
-			if (!len) {
-				free(buf);
-				buf = NULL;
+		s = __recv(os, os->os_inbuf + os->os_inlen, BUFSIZ);
+		if (s <= 0) {
+			/* orderly shutdown or a real error on the socket */
+			if (!s || (os->os_flags & OSFLAG_ENCRYPTED
+					? gnutls_error_is_fatal(s)
+					: errno != EAGAIN && errno != EINTR)) {
+				__obbysess_lost(os);
+				return;
 			}
+
 			break;
 		}
 
-		len += s;
-		buf[len] = 0;
+		os->os_inlen += s;
+		os->os_inbuf[os->os_inlen] = 0;
+		os->os_stats.st_bytes_in += s;
+		os->os_last_rx = obby_clock_ms();
 
 		if (s < BUFSIZ)
 			break;
 	}
 
-	os->os_inbuf = buf;
-
 	/* proceed to parse inbuf */
 	parse_inbuf(os);
 
-	/* send our replys */
+	/* send our replys, then the next bit of an upload if there's room */
+	corked = obbysess_outq(os) && __obbysess_cork(os, 1);
 	send_outbuf(os);
+	__obbysess_upload_pump(os);
+	send_outbuf(os);
+	if (corked)
+		__obbysess_cork(os, 0);
+}
+
+static void __obbysess_login(struct obbysess *os)
+{
+	obbysess_enqueue_command(os, OBBY_PRIO_CONTROL,
+			"net6_client_login:%s:%s\n",
+			os->os_nick, os->os_color);
 }
 
+/*
+ * Log in with @nick and @color; if the handshake isn't done yet, this
+ * will happen as soon as it is. Either way, the session will log in
+ * again with these after a reconnect.
+ */
 void obbysess_join(struct obbysess *os, const char *nick, const char *color)
 {
-	obbysess_enqueue_command(os, "net6_client_login:%s:%s\n", nick, color);
+	char *n = strdup(nick), *c = strdup(color);
+
+	if (!n || !c) {
+		free(n);
+		free(c);
+		os->os_state = OSSTATE_ERROR;
+		return;
+	}
+
+	free(os->os_nick);
+	free(os->os_color);
+	os->os_nick = n;
+	os->os_color = c;
+
+	if (os->os_state == OSSTATE_SHOOKHANDS)
+		__obbysess_login(os);
 }
 
-void obbysess_subscribe(struct obbysess *os, const char *docname)
+/* remember a document we have open, so that we can resubscribe after a
+ * reconnect */
+static void __obbysess_remember(struct obbysess *os, struct obbydoc *od)
+{
+	obbyatom_t *subs;
+	int i;
+
+	for (i = 0; i < os->os_nsubs; i++)
+		if (os->os_subs[i] == od->od_atom)
+			return;
+
+	subs = realloc(os->os_subs, (os->os_nsubs + 1) * sizeof(obbyatom_t));
+	if (subs) {
+		subs[os->os_nsubs++] = od->od_atom;
+		os->os_subs = subs;
+	}
+}
+
+/*
+ * Open document @docname; -1 if we don't know it, or if the request
+ * can't be queued just now
+ */
+int obbysess_subscribe(struct obbysess *os, const char *docname)
 {
 	struct obbydoc *od;
 
 	od = obbydoc_find_by_name(os, docname);
+	if (!od) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (obbysess_enqueue_command(os, OBBY_PRIO_BULK,
+				"obby_document:%lx %lx:subscribe:0\n",
+				od->od_obbyuid, od->od_obbyuididx))
+		return -1;
+
+	__obbysess_remember(os, od);
+
+	return 0;
+}
+
+/*
+ * Our own edits go out as records, but not one per keystroke: an edit
+ * is held back in os_batch, and the ones after it are merged into it for
+ * as long as they carry on where it left off: typing on, deleting
+ * forward or backward, or backspacing over what was just typed. It is
+ * sent once the edits stop for OBBY_BATCH_MS (or, without a timer wheel,
+ * on the next obbysess_do()), once it has been held OBBY_BATCH_MAX_MS or
+ * has OBBY_BATCH_BYTES of text, when the next edit goes elsewhere, and
+ * before anything else is sent or any record for the same document is
+ * taken in, since it says how many of those it has seen.
+ */
+
+/* characters in @len bytes of UTF-8 */
+static unsigned long __chars(const char *s, size_t len)
+{
+	unsigned long n = 0;
+
+	for (; len; s++, len--)
+		n += (*s & 0xc0) != 0x80;
+
+	return n;
+}
+
+void obbysess_flush_edits(struct obbysess *os)
+{
+	struct obbybatch *ob = &os->os_batch;
+	struct obbydoc *od = ob->ob_doc;
+	char *esc;
+
 	if (!od)
 		return;
 
-	obbysess_enqueue_command(os, "obby_document:%lx %lx:subscribe:0\n",
-			od->od_obbyuid, od->od_obbyuididx);
+	/* before enqueueing, which flushes too */
+	ob->ob_doc = NULL;
+	obbytimer_cancel(&ob->ob_timer);
+
+	/* typed and backspaced over again */
+	if (!ob->ob_len)
+		return;
+
+	if (ob->ob_insert) {
+		esc = obby_escape_string(ob->ob_text, 0);
+		if (!esc) {
+			os->os_state = OSSTATE_ERROR;
+			return;
+		}
+
+		__obbysess_queue(os, OBBY_PRIO_INTERACTIVE,
+				"obby_document:%lx %lx:record:%lx:%lx:ins:%lx:%s\n",
+				od->od_obbyuid, od->od_obbyuididx, od->od_local++,
+				od->od_remote, ob->ob_pos, esc);
+		free(esc);
+	} else
+		__obbysess_queue(os, OBBY_PRIO_INTERACTIVE,
+				"obby_document:%lx %lx:record:%lx:%lx:del:%lx:%lx\n",
+				od->od_obbyuid, od->od_obbyuididx, od->od_local++,
+				od->od_remote, ob->ob_pos, ob->ob_len);
+
+	os->os_stats.st_edit_records++;
 }
 
-void obbysess_set_notify_callback(struct obbysess *os,
-		obbysess_notify_callback_t func, void *priv)
+static void __obbysess_batch_expire(struct obbytimer *t, void *priv)
 {
-	os->os_notify_user = func;
-	os->os_notify_priv = priv;
+	struct obbysess *os = priv;
+	struct obbybatch *ob = &os->os_batch;
+	unsigned long long now = obby_clock_ms();
+	unsigned long long quiet = ob->ob_last + OBBY_BATCH_MS;
+	unsigned long long end = ob->ob_first + OBBY_BATCH_MAX_MS;
+
+	/* like the idle timer, it isn't re-armed for every edit */
+	if (now < quiet && now < end) {
+		obbytimer_arm(os->os_wheel, t, (quiet < end ? quiet : end) - now);
+		return;
+	}
+
+	obbysess_flush_edits(os);
+	send_outbuf(os);
 }
 
-void obbysess_destroy(struct obbysess *os)
+/*
+ * Merge an edit (@len characters of @text, @bytes long, inserted at @pos
+ * or deleted from there) into the one held back; -1 if it doesn't carry
+ * on from it
+ */
+static int __obbysess_merge(struct obbybatch *ob, struct obbydoc *od,
+		int insert, unsigned long pos, const char *text, size_t bytes,
+		unsigned long len)
+{
+	unsigned long n;
+	char *p;
+
+	if (ob->ob_doc != od)
+		return -1;
+
+	if (ob->ob_insert && insert) {
+		if (pos != ob->ob_pos + ob->ob_len ||
+				ob->ob_textlen + bytes > OBBY_BATCH_BYTES ||
+				__reserve(&ob->ob_text, &ob->ob_textsize,
+					ob->ob_textlen + bytes + 1))
+			return -1;
+
+		memcpy(ob->ob_text + ob->ob_textlen, text, bytes + 1);
+		ob->ob_textlen += bytes;
+		ob->ob_len += len;
+
+		return 0;
+	}
+
+	if (ob->ob_insert) {
+		if (len > ob->ob_len || pos + len != ob->ob_pos + ob->ob_len)
+			return -1;
+
+		p = ob->ob_text + ob->ob_textlen;
+		for (n = len; n; n--)
+			while ((*--p & 0xc0) == 0x80)
+				;
+
+		*p = 0;
+		ob->ob_textlen = p - ob->ob_text;
+		ob->ob_len -= len;
+
+		return 0;
+	}
+
+	if (insert)
+		return -1;
+
+	if (pos + len == ob->ob_pos)
+		ob->ob_pos = pos;
+	else if (pos != ob->ob_pos)
+		return -1;
+
+	ob->ob_len += len;
+
+	return 0;
+}
+
+static int __obbysess_edit(struct obbysess *os, const char *docname,
+		int insert, unsigned long pos, const char *text,
+		unsigned long len)
+{
+	struct obbybatch *ob = &os->os_batch;
+	size_t bytes = insert ? strlen(text) : 0;
+	struct obbydoc *od;
+
+	od = obbydoc_find_by_name(os, docname);
+	if (!od)
+		return -1;
+
+	if (insert)
+		len = __chars(text, bytes);
+
+	os->os_stats.st_edits++;
+	ob->ob_last = obby_clock_ms();
+	if (!__obbysess_merge(ob, od, insert, pos, text, bytes, len))
+		return 0;
+
+	obbysess_flush_edits(os);
+	if (insert && __reserve(&ob->ob_text, &ob->ob_textsize, bytes + 1)) {
+		os->os_state = OSSTATE_ERROR;
+		return -1;
+	}
+
+	ob->ob_doc = od;
+	ob->ob_insert = insert;
+	ob->ob_pos = pos;
+	ob->ob_len = len;
+	ob->ob_textlen = bytes;
+	if (insert)
+		memcpy(ob->ob_text, text, bytes + 1);
+	ob->ob_first = ob->ob_last;
+
+	if (os->os_wheel)
+		obbytimer_arm(os->os_wheel, &ob->ob_timer, OBBY_BATCH_MS);
+
+	return 0;
+}
+
+/*
+ * Send an edit of our own to document @docname: @text inserted at @pos,
+ * or @len characters deleted from @pos. Returns -1 if we don't know the
+ * document.
+ *
+ * XXX: like the records we get, these aren't transformed against ones
+ * the server has sent that we haven't seen yet
+ */
+int obbysess_insert(struct obbysess *os, const char *docname,
+		unsigned long pos, const char *text)
+{
+	return __obbysess_edit(os, docname, 1, pos, text, 0);
+}
+
+int obbysess_delete(struct obbysess *os, const char *docname,
+		unsigned long pos, unsigned long len)
+{
+	return __obbysess_edit(os, docname, 0, pos, NULL, len);
+}
+
+/*
+ * Uploads: a local file made into a new document. The file is mapped
+ * rather than read, and goes out as records appending to the document,
+ * each with no more than OBBY_UPLOAD_CHUNK bytes of it, one per call to
+ * obbysess_do() and only while the bulk queue is short: pings, chat and
+ * edits go ahead of it anyway, but subscriptions don't wait behind more
+ * than a couple of chunks, the upload doesn't eat up the session's
+ * queue limit, and other sessions get their turn in between.
+ *
+ * XXX: the file shouldn't be truncated while it's being uploaded, or we
+ * get a SIGBUS for it
+ */
+
+/* escape @len bytes of @src into @dst, which has room for twice that */
+static void __escape(char *dst, const char *src, size_t len)
+{
+	for (; len; src++, len--) {
+		if (*src == '\\' || *src == ':' || *src == '\n') {
+			*dst++ = '\\';
+			*dst++ = *src == '\\' ? 'b' : *src == ':' ? 'd' : 'n';
+		} else
+			*dst++ = *src;
+	}
+
+	*dst = 0;
+}
+
+static void __obbysess_upload_free(struct obbysess *os)
+{
+	struct obbyupload *up = os->os_upload;
+
+	if (up->up_len)
+		munmap((void *)up->up_data, up->up_len);
+	free(up->up_buf);
+	free(up);
+	os->os_upload = NULL;
+}
+
+static void __obbysess_upload_pump(struct obbysess *os)
+{
+	struct obbyupload *up = os->os_upload;
+	struct obbydoc *od;
+	size_t end;
+
+	if (!up || !up->up_doc)
+		return;
+
+	od = up->up_doc;
+	if (up->up_off < up->up_len) {
+		if (obbysess_outq_prio(os, OBBY_PRIO_BULK) >= OBBY_UPLOAD_QUEUE)
+			return;
+
+		/* not splitting a character */
+		end = up->up_off + OBBY_UPLOAD_CHUNK;
+		if (end >= up->up_len)
+			end = up->up_len;
+		else
+			while ((up->up_data[end] & 0xc0) == 0x80)
+				end--;
+
+		__escape(up->up_buf, up->up_data + up->up_off,
+				end - up->up_off);
+
+		/* the same chunk is tried again if the queues are full */
+		if (obbysess_enqueue_command(os, OBBY_PRIO_BULK,
+					"obby_document:%lx %lx:record:"
+					"%lx:%lx:ins:%lx:%s\n", od->od_obbyuid,
+					od->od_obbyuididx, od->od_local,
+					od->od_remote, up->up_pos, up->up_buf))
+			return;
+
+		od->od_local++;
+		up->up_pos += __chars(up->up_data + up->up_off,
+				end - up->up_off);
+		up->up_off = end;
+		if (end < up->up_len)
+			return;
+	}
+
+	diag(os, "uploaded %s, %lu bytes in %llu ms\n", od->od_name,
+			(unsigned long)up->up_len,
+			obby_clock_ms() - up->up_start);
+	__obbysess_upload_free(os);
+}
+
+/*
+ * Create document @docname out of the file at @path, which has to be
+ * UTF-8 text. This only gets it started: the rest happens as the session
+ * goes on, and is reported as debug messages. Returns -1, with errno
+ * set, if it can't be started: if the session isn't synced, another
+ * upload is under way, there's a document by that name already, the
+ * file won't do or the queues are full.
+ */
+int obbysess_upload(struct obbysess *os, const char *path,
+		const char *docname)
+{
+	struct obbyupload *up;
+	struct obbyuser *ou;
+	struct stat st;
+	char *name;
+	void *data = NULL;
+	int i, fd, err;
+
+	if (os->os_state != OSSTATE_SYNCED || !os->os_nick) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (os->os_upload) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!*docname) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (obbydoc_find_by_name(os, docname)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	ou = obbyuser_find_by_name(os, os->os_nick, strlen(os->os_nick));
+	if (!ou) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		err = errno;
+		goto out_close;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		err = EINVAL;
+		goto out_close;
+	}
+
+	if (st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			err = errno;
+			goto out_close;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	/* a NUL would cut a record short */
+	if (st.st_size && (obby_utf8_valid(data, st.st_size) != st.st_size ||
+				memchr(data, 0, st.st_size))) {
+		err = EILSEQ;
+		goto out_unmap;
+	}
+
+	err = ENOMEM;
+	up = calloc(1, sizeof(struct obbyupload));
+	if (!up)
+		goto out_unmap;
+
+	up->up_buf = malloc(OBBY_UPLOAD_CHUNK * 2 + 1);
+	name = obby_escape_string(docname, 0);
+	up->up_name = obby_intern(os, docname, strlen(docname));
+	if (!up->up_buf || !name || up->up_name == OBBYATOM_NONE) {
+		free(up->up_buf);
+		free(up);
+		free(name);
+		goto out_unmap;
+	}
+
+	/* the next of our own document numbers */
+	up->up_uid = ou->ou_obbyuid;
+	for (i = 0; i < os->os_edocs; i++)
+		if (os->os_docs[i]->od_obbyuid == up->up_uid &&
+				os->os_docs[i]->od_obbyuididx >= up->up_idx)
+			up->up_idx = os->os_docs[i]->od_obbyuididx + 1;
+	if (!up->up_idx)
+		up->up_idx = 1;
+
+	up->up_data = data;
+	up->up_len = st.st_size;
+	up->up_start = obby_clock_ms();
+	os->os_upload = up;
+
+	/* created empty, the text follows once the server has made it */
+	if (obbysess_enqueue_command(os, OBBY_PRIO_BULK,
+				"obby_document_create:%lx:%s:UTF-8:\n",
+				up->up_idx, name)) {
+		free(name);
+		__obbysess_upload_free(os);
+		errno = EAGAIN;
+		return -1;
+	}
+	free(name);
+
+	return 0;
+
+out_close:
+	close(fd);
+	errno = err;
+	return -1;
+
+out_unmap:
+	if (data)
+		munmap(data, st.st_size);
+	errno = err;
+	return -1;
+}
+
+unsigned long long obby_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long obby_clock_ms(void)
+{
+	return obby_clock_ns() / 1000000;
+}
+
+const char *obby_command_name(int cmd)
+{
+	return cmd >= 0 && cmd < ARRSZ(cmdlist) ? cmdlist[cmd].oc_string : NULL;
+}
+
+static const char *const event_names[OETYPE_NR] = {
+	[OETYPE_NONE]		= "none",
+	[OETYPE_USER_KNOWN]	= "user_known",
+	[OETYPE_USER_JOINED]	= "user_joined",
+	[OETYPE_USER_PARTED]	= "user_parted",
+	[OETYPE_DOC_KNOWN]	= "doc_known",
+	[OETYPE_DOC_OPEN]	= "doc_open",
+	[OETYPE_DOC_GETCHUNK]	= "doc_getchunk",
+	[OETYPE_DOC_INSERT]	= "doc_insert",
+	[OETYPE_DOC_DELETE]	= "doc_delete",
+	[OETYPE_CHAT_MESSAGE]	= "chat_message",
+	[OETYPE_DEBUG_MESSAGE]	= "debug_message",
+	[OETYPE_DISCONNECT]	= "disconnect",
+	[OETYPE_RECONNECT]	= "reconnect",
+};
+
+static const char *const prio_names[OBBY_PRIO_NR] = {
+	[OBBY_PRIO_CONTROL]	= "control",
+	[OBBY_PRIO_INTERACTIVE]	= "interactive",
+	[OBBY_PRIO_BULK]	= "bulk",
+};
+
+const char *obby_prio_name(int prio)
+{
+	return prio >= 0 && prio < OBBY_PRIO_NR ? prio_names[prio] : NULL;
+}
+
+const char *obby_event_name(int type)
+{
+	return type >= 0 && type < OETYPE_NR ? event_names[type] : NULL;
+}
+
+/* bytes waiting to be sent */
+unsigned long obbysess_outq(struct obbysess *os)
+{
+	unsigned long n = 0;
+	int prio;
+
+	for (prio = 0; prio < OBBY_PRIO_NR; prio++)
+		n += obbysess_outq_prio(os, prio);
+
+	return n;
+}
+
+/* and of those, with priority @prio */
+unsigned long obbysess_outq_prio(struct obbysess *os, int prio)
+{
+	return os->os_outq[prio].oq_tail - os->os_outq[prio].oq_head;
+}
+
+/* how many bytes may be queued before commands are refused */
+void obbysess_set_outq_limit(struct obbysess *os, unsigned long bytes)
+{
+	os->os_outmax = bytes;
+}
+
+/*
+ * How much input may pile up waiting for the end of a line; a sync
+ * chunk that doesn't fit is passed on in pieces, anything else is an
+ * error
+ */
+void obbysess_set_inbuf_limit(struct obbysess *os, unsigned long bytes)
+{
+	if (bytes < OBBY_STREAM_MIN + BUFSIZ + 1)
+		bytes = OBBY_STREAM_MIN + BUFSIZ + 1;
+
+	os->os_inmax = bytes;
+}
+
+/*
+ * Input that has already been read off the socket (by TLS) but not
+ * parsed yet; obbysess_do() should be called even if the socket isn't
+ * readable
+ */
+int obbysess_pending(struct obbysess *os)
+{
+	return os->os_flags & OSFLAG_ENCRYPTED &&
+		gnutls_record_check_pending(os->os_tlssess);
+}
+
+#define STATS_SIMPLE(__f, __os, __n, __name, __type, __help, __expr) \
+	do { \
+		int __i; \
+		fprintf(__f, "# HELP " __name " " __help "\n" \
+				"# TYPE " __name " " __type "\n"); \
+		for (__i = 0; __i < __n; __i++) \
+			if (__os[__i]) \
+				fprintf(__f, __name "{session=\"%d\"} %llu\n", \
+					__i, (unsigned long long)(__expr)); \
+	} while (0)
+
+/*
+ * Write counters of @n sessions in Prometheus text exposition format;
+ * sessions are labelled with their index in @os, NULL entries skipped
+ */
+void obbysess_stats_export(FILE *f, struct obbysess *const *os, int n)
+{
+	int i, c;
+
+	STATS_SIMPLE(f, os, n, "obby_received_bytes_total", "counter",
+			"Bytes received from the server.",
+			os[__i]->os_stats.st_bytes_in);
+	STATS_SIMPLE(f, os, n, "obby_sent_bytes_total", "counter",
+			"Bytes sent to the server.",
+			os[__i]->os_stats.st_bytes_out);
+	STATS_SIMPLE(f, os, n, "obby_unknown_commands_total", "counter",
+			"Commands not understood by cobby.",
+			os[__i]->os_stats.st_unknown_cmds);
+	STATS_SIMPLE(f, os, n, "obby_parse_errors_total", "counter",
+			"Commands that failed to parse.",
+			os[__i]->os_stats.st_parse_errors);
+	STATS_SIMPLE(f, os, n, "obby_outbound_queue_bytes", "gauge",
+			"Bytes waiting to be sent.",
+			obbysess_outq(os[__i]));
+	STATS_SIMPLE(f, os, n, "obby_outbound_queue_peak_bytes", "gauge",
+			"Largest outbound queue seen.",
+			os[__i]->os_stats.st_outq_peak);
+	STATS_SIMPLE(f, os, n, "obby_outbound_refused_total", "counter",
+			"Commands refused for the outbound queue limit.",
+			os[__i]->os_stats.st_outq_full);
+	STATS_SIMPLE(f, os, n, "obby_streamed_chunks_total", "counter",
+			"Sync chunks too long to buffer, passed on in pieces.",
+			os[__i]->os_stats.st_streamed);
+	STATS_SIMPLE(f, os, n, "obby_last_sync_microseconds", "gauge",
+			"Duration of the last sync exchange.",
+			os[__i]->os_stats.st_sync_ns / 1000);
+	STATS_SIMPLE(f, os, n, "obby_pings_sent_total", "counter",
+			"Keepalive pings sent on idle connections.",
+			os[__i]->os_stats.st_pings);
+	STATS_SIMPLE(f, os, n, "obby_reconnects_total", "counter",
+			"Successful reconnects.",
+			os[__i]->os_stats.st_reconnects);
+	STATS_SIMPLE(f, os, n, "obby_ping_rtt_microseconds", "gauge",
+			"Round trip time of the last keepalive ping.",
+			os[__i]->os_stats.st_rtt_ns / 1000);
+	STATS_SIMPLE(f, os, n, "obby_invalid_utf8_bytes_total", "counter",
+			"Bytes of invalid UTF-8 replaced in document text.",
+			os[__i]->os_stats.st_bad_utf8);
+	STATS_SIMPLE(f, os, n, "obby_converted_bytes_total", "counter",
+			"Bytes of document text converted to UTF-8.",
+			os[__i]->os_stats.st_conv_bytes);
+	STATS_SIMPLE(f, os, n, "obby_conversion_errors_total", "counter",
+			"Bytes not valid in their document's encoding.",
+			os[__i]->os_stats.st_conv_errors);
+	STATS_SIMPLE(f, os, n, "obby_edits_total", "counter",
+			"Edits of our own, as they were made.",
+			os[__i]->os_stats.st_edits);
+	STATS_SIMPLE(f, os, n, "obby_edit_records_total", "counter",
+			"Records sent for them, after merging.",
+			os[__i]->os_stats.st_edit_records);
+	STATS_SIMPLE(f, os, n, "obby_session_state", "gauge",
+			"Session state (OSSTATE_*).",
+			os[__i]->os_state);
+
+	fprintf(f, "# HELP obby_commands_total Commands received, by type.\n"
+			"# TYPE obby_commands_total counter\n");
+	for (i = 0; i < n; i++)
+		for (c = 0; os[i] && c < ARRSZ(cmdlist); c++)
+			fprintf(f, "obby_commands_total{session=\"%d\","
+					"command=\"%s\"} %lu\n", i,
+					cmdlist[c].oc_string,
+					os[i]->os_stats.st_cmds[c]);
+
+	fprintf(f, "# HELP obby_outbound_queue_class_bytes Bytes waiting "
+			"to be sent, by priority.\n"
+			"# TYPE obby_outbound_queue_class_bytes gauge\n");
+	for (i = 0; i < n; i++)
+		for (c = 0; os[i] && c < OBBY_PRIO_NR; c++)
+			fprintf(f, "obby_outbound_queue_class_bytes{session=\"%d\","
+					"class=\"%s\"} %lu\n", i,
+					prio_names[c],
+					obbysess_outq_prio(os[i], c));
+
+	fprintf(f, "# HELP obby_events_total Events delivered, by type.\n"
+			"# TYPE obby_events_total counter\n");
+	for (i = 0; i < n; i++)
+		for (c = 1; os[i] && c < OETYPE_NR; c++)
+			fprintf(f, "obby_events_total{session=\"%d\","
+					"type=\"%s\"} %lu\n", i,
+					event_names[c],
+					os[i]->os_stats.st_events[c]);
+}
+
+/*
+ * Keepalive: rather than re-arming a timer for every bit of incoming
+ * data, the idle timer checks how long it has actually been quiet when
+ * it fires and goes back to sleep for the remainder. After os_ping_ms
+ * of silence we ping the server, after os_dead_ms we give up on it.
+ */
+static void __obbysess_idle(struct obbytimer *t, void *priv)
+{
+	struct obbysess *os = priv;
+	unsigned long long idle = obby_clock_ms() - os->os_last_rx;
+
+	if (idle >= os->os_dead_ms) {
+		err(os, "no word from the server for %llu ms\n", idle);
+		__obbysess_lost(os);
+		return;
+	}
+
+	if (idle >= os->os_ping_ms) {
+		if (!os->os_ping_sent) {
+			obbysess_enqueue_command(os, OBBY_PRIO_CONTROL,
+					"net6_ping\n");
+			send_outbuf(os);
+			os->os_ping_sent = obby_clock_ns();
+			os->os_stats.st_pings++;
+		}
+
+		obbytimer_arm(os->os_wheel, t, os->os_dead_ms - idle);
+	} else
+		obbytimer_arm(os->os_wheel, t, os->os_ping_ms - idle);
+}
+
+/* full jitter exponential backoff */
+static unsigned long __obbysess_backoff(struct obbysess *os)
+{
+	unsigned long base = OBBY_RECONNECT_MIN_MS;
+	unsigned i;
+
+	for (i = 0; i < os->os_retries && base < OBBY_RECONNECT_MAX_MS; i++)
+		base *= 2;
+
+	if (base > OBBY_RECONNECT_MAX_MS)
+		base = OBBY_RECONNECT_MAX_MS;
+
+	os->os_retries++;
+
+	return base / 2 + rand_r(&os->os_seed) % (base / 2 + 1);
+}
+
+/* drop everything that belongs to the current connection */
+static void __obbysess_disconnect(struct obbysess *os)
 {
 	if (os->os_flags & OSFLAG_ENCRYPTED) {
 		gnutls_anon_free_client_credentials(os->os_anoncred);
 		gnutls_deinit(os->os_tlssess);
-		gnutls_global_deinit();
+		os->os_flags &= ~OSFLAG_ENCRYPTED;
 	}
 
-	if (os->os_inbuf)
-		free(os->os_inbuf);
-	if (os->os_outbuf)
-		free(os->os_outbuf);
+	if (os->os_sock != -1)
+		close(os->os_sock);
+	os->os_sock = -1;
+
+	/* the input buffer is kept for the next connection */
+	os->os_inlen = 0;
+	os->os_instream = NULL;
+	os->os_inskip = 0;
+	__outq_reset(os);
+	os->os_ping_sent = 0;
+
+	/* the documents an edit held back refers to are going */
+	os->os_batch.ob_doc = NULL;
+	obbytimer_cancel(&os->os_batch.ob_timer);
+
+	if (os->os_upload) {
+		diag(os, "upload of %s cut short at %lu of %lu bytes\n",
+				obby_atom_name(os, os->os_upload->up_name),
+				(unsigned long)os->os_upload->up_off,
+				(unsigned long)os->os_upload->up_len);
+		__obbysess_upload_free(os);
+	}
 
 	obbysess_free_docs(os);
 	obbysess_free_users(os);
+	os->os_nitems = 0;
+}
+
+/*
+ * The connection is gone; without a timer wheel that's the end of the
+ * session, otherwise schedule a reconnect
+ */
+static void __obbysess_lost(struct obbysess *os)
+{
+	unsigned long delay;
+
+	if (!os->os_wheel) {
+		os->os_state = OSSTATE_ERROR;
+		return;
+	}
+
+	__obbysess_disconnect(os);
+	obbytimer_cancel(&os->os_idle_timer);
+
+	delay = __obbysess_backoff(os);
+	diag(os, "connection lost, reconnecting in %lu ms\n", delay);
+
+	os->os_state = OSSTATE_RECONNECT;
+	obbytimer_arm(os->os_wheel, &os->os_reconnect_timer, delay);
+	obbysess_notify(os, OETYPE_DISCONNECT, .oe_length = delay);
+}
+
+static void __obbysess_reconnect(struct obbytimer *t, void *priv)
+{
+	struct obbysess *os = priv;
+	unsigned long delay;
+	int sock;
+
+	/* XXX: connect() blocks */
+	sock = __obbysess_create_client(os->os_host, os->os_port);
+	if (sock == -1) {
+		delay = __obbysess_backoff(os);
+		diag(os, "reconnect failed, next try in %lu ms\n", delay);
+		obbytimer_arm(os->os_wheel, t, delay);
+		return;
+	}
+
+	os->os_sock = sock;
+	os->os_state = OSSTATE_OPEN;
+	os->os_last_rx = obby_clock_ms();
+	os->os_stats.st_reconnects++;
+	__obbysess_sockopts(os);
+	obbytimer_arm(os->os_wheel, &os->os_idle_timer, os->os_ping_ms);
+
+	obbysess_notify(os, OETYPE_RECONNECT);
+}
+
+/*
+ * Let the session keep its timers on @w: this enables keepalive pings,
+ * dead peer detection and reconnects
+ */
+void obbysess_set_timers(struct obbysess *os, struct obbywheel *w)
+{
+	obbysess_flush_edits(os);
+	obbytimer_cancel(&os->os_idle_timer);
+	obbytimer_cancel(&os->os_reconnect_timer);
+
+	os->os_wheel = w;
+	if (w && os->os_state != OSSTATE_RECONNECT)
+		obbytimer_arm(w, &os->os_idle_timer, os->os_ping_ms);
+}
+
+/*
+ * Start collecting latency histograms for this session, and write
+ * spans to @tr (if not NULL) with thread id @tid
+ */
+void obbysess_default_sockopts(struct obbysockopts *so)
+{
+	memset(so, 0, sizeof(*so));
+	so->so_nodelay = 1;
+	so->so_cork = 1;
+	so->so_keepalive = 1;
+	so->so_keepidle = OBBY_KEEPIDLE_S;
+	so->so_keepintvl = OBBY_KEEPINTVL_S;
+	so->so_keepcnt = OBBY_KEEPCNT;
+}
+
+static int __setopt(struct obbysess *os, int level, int name, int val)
+{
+	return setsockopt(os->os_sock, level, name, &val, sizeof(val));
+}
+
+/*
+ * Apply os_sockopts to the socket; -1 if any of them won't go
+ *
+ * XXX: this happens once connected, when a bigger receive buffer no
+ * longer gets a bigger window scale
+ */
+static int __obbysess_sockopts(struct obbysess *os)
+{
+	struct obbysockopts *so = &os->os_sockopts;
+	int ret = 0;
+
+	if (os->os_sock == -1)
+		return 0;
+
+	ret |= __setopt(os, IPPROTO_TCP, TCP_NODELAY, !!so->so_nodelay);
+	if (so->so_sndbuf)
+		ret |= __setopt(os, SOL_SOCKET, SO_SNDBUF, so->so_sndbuf);
+	if (so->so_rcvbuf)
+		ret |= __setopt(os, SOL_SOCKET, SO_RCVBUF, so->so_rcvbuf);
+
+	ret |= __setopt(os, SOL_SOCKET, SO_KEEPALIVE, !!so->so_keepalive);
+	if (so->so_keepalive && so->so_keepidle)
+		ret |= __setopt(os, IPPROTO_TCP, TCP_KEEPIDLE, so->so_keepidle);
+	if (so->so_keepalive && so->so_keepintvl)
+		ret |= __setopt(os, IPPROTO_TCP, TCP_KEEPINTVL,
+				so->so_keepintvl);
+	if (so->so_keepalive && so->so_keepcnt)
+		ret |= __setopt(os, IPPROTO_TCP, TCP_KEEPCNT, so->so_keepcnt);
+
+	if (ret)
+		diag(os, "can't set socket options: %s\n", strerror(errno));
+
+	return ret;
+}
+
+/*
+ * Hold back partial segments while obbysess_do() sends (@on), and push
+ * out whatever's left of them once it's done; 1 if the socket is corked
+ */
+static int __obbysess_cork(struct obbysess *os, int on)
+{
+	if (!os->os_sockopts.so_cork || os->os_sock == -1)
+		return 0;
+
+	return !__setopt(os, IPPROTO_TCP, TCP_CORK, on) && on;
+}
+
+/*
+ * Change what the session does with its socket, now and after every
+ * reconnect; -1 if the socket won't take some of it
+ */
+int obbysess_set_sockopts(struct obbysess *os,
+		const struct obbysockopts *so)
+{
+	/* not corking any more; it mustn't stay corked either */
+	if (os->os_sockopts.so_cork && !so->so_cork && os->os_sock != -1)
+		__setopt(os, IPPROTO_TCP, TCP_CORK, 0);
+
+	os->os_sockopts = *so;
+
+	return __obbysess_sockopts(os);
+}
+
+int obbysess_set_timing(struct obbysess *os, struct obbytrace *tr, int tid)
+{
+	if (!os->os_timing) {
+		os->os_timing = calloc(1, sizeof(struct obbytiming));
+		if (!os->os_timing)
+			return -1;
+	}
+
+	os->os_timing->ot_trace = tr;
+	os->os_timing->ot_tid = tid;
+
+	return 0;
+}
+
+void obbysess_set_notify_callback(struct obbysess *os,
+		obbysess_notify_callback_t func, void *priv)
+{
+	os->os_notify_user = func;
+	os->os_notify_priv = priv;
+}
+
+/*
+ * Events of a session without a callback wait in a queue for
+ * obbysess_next_event(), their payloads copied to a buffer of the
+ * session's. Neither is ever shrunk, and both start over once the
+ * queue has been drained, so once they have grown to what the traffic
+ * needs, queueing an event costs no allocation.
+ */
+struct obbyqevent {
+	struct obbyevent qe_ev;
+	size_t qe_msg;		/* offset in os_evbuf, -1 if none */
+	size_t qe_len;
+};
+
+void obbysess_queue_event(struct obbysess *os, struct obbyevent *oe)
+{
+	struct obbyqevent *qe;
+	size_t size;
+
+	if (os->os_evqhead == os->os_nevq)
+		os->os_evqhead = os->os_nevq = os->os_evlen = 0;
+
+	if (os->os_nevq == os->os_evqsize) {
+		size = os->os_evqsize ? os->os_evqsize * 2 : 64;
+		qe = realloc(os->os_evq, size * sizeof(*qe));
+		if (!qe)
+			goto out_err;
+
+		os->os_evq = qe;
+		os->os_evqsize = size;
+	}
+
+	qe = &os->os_evq[os->os_nevq];
+	qe->qe_ev = *oe;
+	qe->qe_ev.oe_message = NULL;
+	qe->qe_msg = -1;
+
+	if (oe->oe_message) {
+		qe->qe_len = strlen(oe->oe_message) + 1;
+		if (__reserve(&os->os_evbuf, &os->os_evsize,
+					os->os_evlen + qe->qe_len))
+			goto out_err;
+
+		memcpy(os->os_evbuf + os->os_evlen, oe->oe_message,
+				qe->qe_len);
+		qe->qe_msg = os->os_evlen;
+		os->os_evlen += qe->qe_len;
+	}
+
+	os->os_nevq++;
+	return;
+
+out_err:
+	os->os_state = OSSTATE_ERROR;
+}
+
+/*
+ * Take the next event off the session's queue; returns 0 if there is
+ * none. The event's oe_message is borrowed: it is valid until the next
+ * call, and the same goes for its oe_docname and oe_username, which
+ * point to the session's interned strings, for as long as the session.
+ */
+int obbysess_next_event(struct obbysess *os, struct obbyevent *oe)
+{
+	struct obbyqevent *qe;
+
+	if (os->os_evqhead == os->os_nevq)
+		return 0;
+
+	qe = &os->os_evq[os->os_evqhead++];
+	*oe = qe->qe_ev;
+	if (qe->qe_msg == (size_t)-1)
+		return 1;
+
+	/*
+	 * handing out a copy keeps it valid while whoever handles the event
+	 * calls back into the session and queues more
+	 */
+	if (__reserve(&os->os_evcur, &os->os_evcursize, qe->qe_len)) {
+		os->os_state = OSSTATE_ERROR;
+		return 0;
+	}
+
+	memcpy(os->os_evcur, os->os_evbuf + qe->qe_msg, qe->qe_len);
+	oe->oe_message = os->os_evcur;
+
+	return 1;
+}
+
+void obbysess_destroy(struct obbysess *os)
+{
+	int i;
+
+	obbytimer_cancel(&os->os_idle_timer);
+	obbytimer_cancel(&os->os_reconnect_timer);
+	obbytimer_cancel(&os->os_batch.ob_timer);
+
+	__obbysess_disconnect(os);
+
+	obbyconv_free_all(os);
+	obbystrtab_free(&os->os_strtab);
+	free(os->os_inbuf);
+	for (i = 0; i < OBBY_PRIO_NR; i++)
+		free(os->os_outq[i].oq_buf);
+	free(os->os_evq);
+	free(os->os_evbuf);
+	free(os->os_evcur);
+	free(os->os_timing);
+	free(os->os_host);
+	free(os->os_port);
+	free(os->os_nick);
+	free(os->os_color);
+	free(os->os_subs);
+	free(os->os_batch.ob_text);
+	free(os);
 }
 
@@ -1,5 +1,23 @@
 
 #ifndef __COBBY_H__
+#define __COBBY_H__
+
+/*
+ * libcobby: the obby protocol, one struct obbysess per connection.
+ *
+ * The library keeps no state of its own beyond what obby_init() sets up
+ * in gnutls: everything else lives in the session, or in the timer wheel
+ * and tracer the application hands it. Hence:
+ *  + obby_init() and obby_fini() are called once per process, before
+ *    any session exists and after the last one is gone;
+ *  + different sessions may be used from different threads at the same
+ *    time, as long as sessions that share a timer wheel (or a tracer)
+ *    are driven from the same thread as it;
+ *  + a single session is not locked against itself: all calls on it,
+ *    and the callbacks it makes, happen on one thread at a time;
+ *  + obby_escape_string(), obby_unescape_string(), obby_utf8_*() and
+ *    obby_clock_*() don't touch any state at all.
+ */
 
 enum {
 	OSTYPE_NONE = 0,
@@ -14,14 +32,34 @@ enum {
 	OSSTATE_JOINED,
 	OSSTATE_SYNCED,
 	OSSTATE_ERROR,
+	OSSTATE_RECONNECT,	/* connection lost, waiting to reconnect */
 };
 
 #define OSFLAG_ENCRYPTED (0x1)
 
+/*
+ * Interned strings: user and document names (and encodings) are stored
+ * once per session and referred to by small integer atoms, so that name
+ * lookups boil down to comparing integers and users who part and rejoin
+ * don't cost us another copy of their nick.
+ */
+typedef unsigned int obbyatom_t;
+
+#define OBBYATOM_NONE 0
+
+struct obbystrtab {
+	char **st_strs;		/* atom -> string; st_strs[0] is unused */
+	unsigned st_nstrs;
+	unsigned st_size;
+	obbyatom_t *st_hash;	/* open addressing, OBBYATOM_NONE == empty */
+	unsigned st_hsize;
+};
+
 #define MAX_USERS 256
 
 struct obbyuser {
-	char *ou_name;
+	char *ou_name;		/* points into the session's string table */
+	obbyatom_t ou_atom;
 	unsigned long ou_color;
 	unsigned long ou_net6uid;
 	unsigned long ou_obbyuid;
@@ -30,20 +68,43 @@ struct obbyuser {
 
 #define MAX_DOCS 1024
 
+/* conversion from a document's encoding to UTF-8, see iconv.c */
+struct obbyconv;
+
 struct obbydoc {
-	char *od_name;
+	char *od_name;		/* interned, as are the following */
 	char *od_encoding;
+	obbyatom_t od_atom;
 	unsigned long od_obbyuid;
 	unsigned long od_obbyuididx;
 	unsigned od_nusers;
+
+	/* NULL for UTF-8 (or an encoding iconv can't convert) */
+	struct obbyconv *od_conv;
+	/* positions count characters: a single byte encoding is converted */
+	unsigned od_charpos;
+	/* incomplete character at the end of the last sync chunk */
+	char od_partial[8];
+	unsigned od_npartial;
+
+	/* jupiter state vector */
+	unsigned long od_local;
+	unsigned long od_remote;
 };
 
+/*
+ * Nothing in an event belongs to whoever gets it: names are the
+ * session's interned strings, and oe_message (already unescaped) only
+ * lasts for the callback, or until the next obbysess_next_event()
+ */
 struct obbyevent {
 	int oe_type;
 	char *oe_docname;
 	char *oe_username;
 	char *oe_message;
+	long oe_pos;
 	long oe_length;
+	unsigned oe_flags;
 	/* to be extended */
 };
 
@@ -55,30 +116,245 @@ enum {
 	OETYPE_DOC_KNOWN,
 	OETYPE_DOC_OPEN,
 	OETYPE_DOC_GETCHUNK,
+	OETYPE_DOC_INSERT,
+	OETYPE_DOC_DELETE,
 	OETYPE_CHAT_MESSAGE,
 	OETYPE_DEBUG_MESSAGE,
+	OETYPE_DISCONNECT,
+	OETYPE_RECONNECT,
+	OETYPE_NR,
 };
 
+/* oe_pos, and oe_length of deletions, count characters, not bytes */
+#define OEFLAG_CHARS (0x1)
+
 typedef int (*obbysess_notify_callback_t)(void *, struct obbyevent *);
 
 #define obbysess_notify(__os, __type, __args...) \
 	do { \
 		struct obbyevent __oe = { .oe_type = __type, ## __args }; \
+		__os->os_stats.st_events[__type]++; \
 		if (__os->os_notify_user) \
 			__os->os_notify_user(__os->os_notify_priv, &__oe); \
+		else \
+			obbysess_queue_event(__os, &__oe); \
 	} while (0);
 
+/* timer wheel, see timer.c */
+#define OBBYWHEEL_TICK_MS 10
+#define OBBYWHEEL_BITS 6
+#define OBBYWHEEL_SLOTS (1 << OBBYWHEEL_BITS)
+#define OBBYWHEEL_LEVELS 4
+
+struct obbytimer;
+struct obbywheel;
+typedef void (*obbytimer_fn_t)(struct obbytimer *, void *);
+
+struct obbytimer {
+	struct obbytimer *t_next;
+	struct obbytimer **t_pprev;
+	unsigned long long t_expires;	/* in ticks */
+	obbytimer_fn_t t_fn;
+	void *t_priv;
+	struct obbywheel *t_wheel;
+};
+
+struct obbywheel {
+	unsigned long long w_ticks;	/* next tick to be processed */
+	unsigned long w_pending;
+	struct obbytimer *w_slots[OBBYWHEEL_LEVELS][OBBYWHEEL_SLOTS];
+};
+
+/* keepalive and reconnection defaults */
+#define OBBY_PING_MS		30000
+#define OBBY_DEAD_MS		90000
+#define OBBY_RECONNECT_MIN_MS	1000
+#define OBBY_RECONNECT_MAX_MS	300000
+
+/*
+ * What a session does with its socket, applied again on every
+ * reconnect; obbysess_default_sockopts() has the defaults:
+ *  + so_nodelay: no Nagle, an edit or a keystroke's worth of chat goes
+ *    out as soon as it's sent;
+ *  + so_cork: but what obbysess_do() sends in one go (the replies to
+ *    everything it has parsed, say) is corked into full segments;
+ *  + so_sndbuf, so_rcvbuf: socket buffer sizes, 0 leaves them be;
+ *  + so_keepalive: TCP keepalives after so_keepidle seconds of
+ *    silence, every so_keepintvl seconds, so_keepcnt of them at most;
+ *    0 for any of those leaves the system's setting.
+ */
+struct obbysockopts {
+	int so_nodelay;
+	int so_cork;
+	int so_sndbuf;
+	int so_rcvbuf;
+	int so_keepalive;
+	int so_keepidle;
+	int so_keepintvl;
+	int so_keepcnt;
+};
+
+#define OBBY_KEEPIDLE_S		60
+#define OBBY_KEEPINTVL_S	10
+#define OBBY_KEEPCNT		6
+
+/*
+ * Our own edits are held back for up to OBBY_BATCH_MS of quiet (but no
+ * more than OBBY_BATCH_MAX_MS in all) to be merged with the next ones
+ */
+#define OBBY_BATCH_MS		50
+#define OBBY_BATCH_MAX_MS	250
+#define OBBY_BATCH_BYTES	4096
+
+/*
+ * A file being uploaded goes out OBBY_UPLOAD_CHUNK bytes at a time, and
+ * only while less than OBBY_UPLOAD_QUEUE bytes of bulk are waiting to be
+ * sent
+ */
+#define OBBY_UPLOAD_CHUNK	16384
+#define OBBY_UPLOAD_QUEUE	16384
+
+/*
+ * Outgoing commands are queued by priority, and the queues are sent
+ * from the most urgent down, a command at a time:
+ *  + control: what keeps the connection going (pongs, pings, login);
+ *  + interactive: chat and edits, which somebody is waiting to see;
+ *  + bulk: whatever may take its time (subscriptions, uploads).
+ * Together they may hold up to OBBY_OUTQ_MAX bytes by default: beyond
+ * that, anything but control is refused until the server has caught up.
+ */
+enum {
+	OBBY_PRIO_CONTROL = 0,
+	OBBY_PRIO_INTERACTIVE,
+	OBBY_PRIO_BULK,
+	OBBY_PRIO_NR,
+};
+
+#define OBBY_OUTQ_MAX		(1024 * 1024)
+
+/*
+ * Received data is buffered up to OBBY_INBUF_MAX bytes by default: a
+ * line that doesn't fit is more than a server should ever send, unless
+ * it's a document's sync chunk, which is passed on in pieces as it comes
+ * once it's OBBY_STREAM_MIN bytes long.
+ */
+#define OBBY_INBUF_MAX		(1024 * 1024)
+#define OBBY_STREAM_MIN		16384
+
+struct obbyoutq {
+	char *oq_buf;
+	size_t oq_head;		/* sent up to here */
+	size_t oq_tail;		/* queued up to here */
+	size_t oq_size;
+};
+
+/* size of per-command counters, must fit all of cobby's cmdlist */
+#define OBBY_MAX_CMDS 32
+
+/*
+ * Per-session counters; everything is cumulative since the session
+ * was created, except for st_sync_ns which is the duration of the last
+ * sync exchange
+ */
+struct obbystats {
+	unsigned long st_bytes_in;
+	unsigned long st_bytes_out;
+	unsigned long st_cmds[OBBY_MAX_CMDS];
+	unsigned long st_unknown_cmds;
+	unsigned long st_parse_errors;
+	unsigned long st_events[OETYPE_NR];
+	unsigned long st_outq_peak;
+	unsigned long st_outq_full;	/* commands refused for it */
+	unsigned long st_streamed;	/* sync chunks passed on in pieces */
+	unsigned long st_pings;
+	unsigned long st_reconnects;
+	unsigned long st_bad_utf8;
+	unsigned long st_conv_bytes;
+	unsigned long st_conv_errors;
+	unsigned long st_edits;		/* ours, as they were made */
+	unsigned long st_edit_records;	/* and as they were sent */
+	unsigned long long st_rtt_ns;
+	unsigned long long st_sync_start;
+	unsigned long long st_sync_ns;
+};
+
+/* latency histograms and span traces, see trace.c */
+#define OBBYHIST_SUB_BITS 3
+#define OBBYHIST_BUCKETS ((64 - OBBYHIST_SUB_BITS + 1) << OBBYHIST_SUB_BITS)
+
+struct obbyhist {
+	unsigned long h_count;
+	unsigned long long h_sum;
+	unsigned long long h_min;
+	unsigned long long h_max;
+	unsigned h_buckets[OBBYHIST_BUCKETS];
+};
+
+struct obbytrace {
+	FILE *tr_file;
+	unsigned long long tr_base;
+	int tr_pid;
+	unsigned long tr_nspans;
+};
+
+/* per-session timings, only allocated when asked for */
+struct obbytiming {
+	struct obbyhist ot_cmds[OBBY_MAX_CMDS];
+	struct obbyhist ot_do;
+	struct obbytrace *ot_trace;
+	int ot_tid;
+};
+
+/* an edit of ours not sent yet, and those merged into it since */
+struct obbybatch {
+	struct obbydoc *ob_doc;		/* NULL if there's none */
+	int ob_insert;
+	unsigned long ob_pos;
+	unsigned long ob_len;		/* characters */
+	char *ob_text;			/* inserted, NUL-terminated */
+	size_t ob_textlen;
+	size_t ob_textsize;
+	unsigned long long ob_first;	/* ms */
+	unsigned long long ob_last;
+	struct obbytimer ob_timer;
+};
+
+/* a file being made into a new document, see obbysess_upload() */
+struct obbyupload {
+	obbyatom_t up_name;
+	unsigned long up_uid;		/* the document's, once created */
+	unsigned long up_idx;
+	struct obbydoc *up_doc;		/* NULL until the server creates it */
+	const char *up_data;		/* the file, mapped */
+	size_t up_len;
+	size_t up_off;			/* bytes sent so far */
+	unsigned long up_pos;		/* and characters */
+	char *up_buf;			/* a chunk, escaped */
+	unsigned long long up_start;	/* ms */
+};
+
 struct obbysess {
 	int os_sock;
 	int os_type;
 	int os_state;
 	unsigned os_flags;
 	long os_proto;
-	char *os_inbuf;
-	char *os_outbuf;
+	char *os_inbuf;		/* received, not yet parsed */
+	size_t os_inlen;
+	size_t os_insize;
+	size_t os_inmax;
+	/* document whose sync chunk os_inbuf continues, if it does */
+	struct obbydoc *os_instream;
+	int os_inskip;		/* up to the newline, the chunk being over */
+	struct obbyoutq os_outq[OBBY_PRIO_NR];
+	int os_outcur;		/* queue a command is half sent from, or -1 */
+	size_t os_outretry;	/* bytes TLS wants offered again, or 0 */
+	unsigned long os_outmax;
 	gnutls_session_t os_tlssess;
 	gnutls_anon_client_credentials_t os_anoncred;
 
+	struct obbystrtab os_strtab;
+
 	long os_nitems; /* scratch: number of entries */
 	int os_eusers; /* number of users known to us */
 	struct obbyuser *os_users[MAX_USERS];
@@ -89,12 +365,63 @@ struct obbysess {
 	/* user's callback */
 	obbysess_notify_callback_t os_notify_user;
 	void *os_notify_priv;
+
+	/* or, without one, events for obbysess_next_event() */
+	struct obbyqevent *os_evq;
+	unsigned os_nevq;
+	unsigned os_evqhead;
+	unsigned os_evqsize;
+	char *os_evbuf;		/* their payloads */
+	size_t os_evlen;
+	size_t os_evsize;
+	char *os_evcur;		/* payload of the event last handed out */
+	size_t os_evcursize;
+
+	struct obbystats os_stats;
+	struct obbytiming *os_timing;
+
+	struct obbysockopts os_sockopts;
+
+	/* what it takes to get the session back after a reconnect */
+	char *os_host;
+	char *os_port;
+	char *os_nick;
+	char *os_color;
+	obbyatom_t *os_subs;
+	unsigned os_nsubs;
+
+	/* keepalive and reconnection, driven by os_wheel */
+	struct obbywheel *os_wheel;
+	struct obbytimer os_idle_timer;
+	struct obbytimer os_reconnect_timer;
+	unsigned long long os_last_rx;	/* ms */
+	unsigned long long os_ping_sent; /* ns, 0 if no ping outstanding */
+	unsigned os_ping_ms;
+	unsigned os_dead_ms;
+	unsigned os_retries;
+	unsigned os_seed;
+
+	/* charset conversion: descriptors and a buffer for the output */
+	struct obbyconv *os_convs;
+	char *os_convbuf;
+	size_t os_convsize;
+
+	struct obbybatch os_batch;
+	struct obbyupload *os_upload;
 };
 
 #define OS_ISOK(__os) ((__os)->os_state != OSSTATE_ERROR)
 
 char *obby_escape_string(const char *input, int replace);
 char *obby_unescape_string(const char *input, int replace);
+size_t obby_unescape(char *str);
+
+obbyatom_t obby_intern(struct obbysess *os, const char *str, size_t len);
+obbyatom_t obby_atom_lookup(struct obbysess *os, const char *str, size_t len);
+const char *obby_atom_name(struct obbysess *os, obbyatom_t atom);
+
+int obby_init(void);
+void obby_fini(void);
 
 struct obbysess *obbysess_create(const char *host, const char *port,
 		int type);
@@ -102,14 +429,71 @@ void obbysess_destroy(struct obbysess *os);
 
 void obbysess_set_notify_callback(struct obbysess *os,
 		obbysess_notify_callback_t func, void *priv);
+void obbysess_queue_event(struct obbysess *os, struct obbyevent *oe);
+int obbysess_next_event(struct obbysess *os, struct obbyevent *oe);
 
 void obbysess_do(struct obbysess *os);
 
 void obbysess_join(struct obbysess *os, const char *nick, const char *color);
 
-void obbysess_subscribe(struct obbysess *os, const char *docname);
+int obbysess_subscribe(struct obbysess *os, const char *docname);
+int obbysess_insert(struct obbysess *os, const char *docname,
+		unsigned long pos, const char *text);
+int obbysess_delete(struct obbysess *os, const char *docname,
+		unsigned long pos, unsigned long len);
+void obbysess_flush_edits(struct obbysess *os);
+int obbysess_upload(struct obbysess *os, const char *path,
+		const char *docname);
+
+int obbysess_enqueue_command(struct obbysess *os, int prio,
+		const char *fmt, ...);
+
+unsigned long long obby_clock_ns(void);
+const char *obby_command_name(int cmd);
+const char *obby_event_name(int type);
+const char *obby_prio_name(int prio);
+unsigned long obbysess_outq(struct obbysess *os);
+unsigned long obbysess_outq_prio(struct obbysess *os, int prio);
+void obbysess_set_outq_limit(struct obbysess *os, unsigned long bytes);
+void obbysess_set_inbuf_limit(struct obbysess *os, unsigned long bytes);
+int obbysess_pending(struct obbysess *os);
+void obbysess_stats_export(FILE *f, struct obbysess *const *os, int n);
+int obbysess_set_timing(struct obbysess *os, struct obbytrace *tr, int tid);
+void obbysess_set_timers(struct obbysess *os, struct obbywheel *w);
+void obbysess_default_sockopts(struct obbysockopts *so);
+int obbysess_set_sockopts(struct obbysess *os,
+		const struct obbysockopts *so);
+
+unsigned long long obby_clock_ms(void);
+void obbywheel_init(struct obbywheel *w, unsigned long long now_ms);
+void obbywheel_run(struct obbywheel *w, unsigned long long now_ms);
+long obbywheel_timeout(struct obbywheel *w, long max_ms,
+		unsigned long long now_ms);
+void obbytimer_init(struct obbytimer *t, obbytimer_fn_t fn, void *priv);
+void obbytimer_arm(struct obbywheel *w, struct obbytimer *t, unsigned long ms);
+void obbytimer_cancel(struct obbytimer *t);
+int obbytimer_pending(struct obbytimer *t);
+
+void obbyhist_record(struct obbyhist *h, unsigned long long v);
+unsigned long long obbyhist_percentile(struct obbyhist *h, double p);
+void obbyhist_reset(struct obbyhist *h);
+void obbyhist_merge(struct obbyhist *dst, const struct obbyhist *src);
+
+int obby_utf8_decode(const char *buf, size_t len, unsigned *cp);
+size_t obby_utf8_valid(const char *buf, size_t len);
+size_t obby_utf8_scrub(char *buf, size_t len);
+
+int obbydoc_set_encoding(struct obbysess *os, struct obbydoc *od,
+		obbyatom_t enc);
+void obbyconv_free_all(struct obbysess *os);
+void obbydoc_convert_reset(struct obbydoc *od);
+char *obbydoc_convert(struct obbysess *os, struct obbydoc *od,
+		const char *text, size_t len, int more);
 
-void obbysess_enqueue_command(struct obbysess *os, const char *fmt, ...);
+struct obbytrace *obbytrace_open(const char *path);
+void obbytrace_close(struct obbytrace *tr);
+void obbytrace_span(struct obbytrace *tr, const char *name, const char *cat,
+		int tid, unsigned long long start, unsigned long long end);
 
 #endif /* __COBBY_H__ */
 
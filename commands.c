@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/poll.h>
 #include <getopt.h>
 #include <gnutls/gnutls.h>
@@ -21,8 +23,12 @@ void cmd_execute(char *cmdbuf, void *d)
 		default:
 			if (os) {
 				char *msg = obby_escape_string(cmdbuf, 0);
-				obbysess_enqueue_command(os, "obby_message:%s\n",
-						msg);
+
+				if (obbysess_enqueue_command(os,
+							OBBY_PRIO_INTERACTIVE,
+							"obby_message:%s\n", msg))
+					__dbgout("can't send that now: %s\n",
+							strerror(errno));
 				free(msg);
 			}
 			break;
@@ -33,8 +39,26 @@ void cmd_execute(char *cmdbuf, void *d)
 		case ':':
 			__dbgout("got command: %s\n", &cmdbuf[1]);
 			if (!strcmp(&cmdbuf[1], "q")) G.state = NSTATE_LEAVING;
+			else if (!strcmp(&cmdbuf[1], "stats"))
+				session_show_stats(s);
+			else if (!strcmp(&cmdbuf[1], "latency"))
+				session_show_latency(s);
+			else if (!strcmp(&cmdbuf[1], "sessions"))
+				session_list();
+			else if (!strncmp(&cmdbuf[1], "session ", 8))
+				session_switch(atoi(&cmdbuf[9]));
+			else if (!strcmp(&cmdbuf[1], "snext") ||
+					!strcmp(&cmdbuf[1], "sprev"))
+				session_cycle(cmdbuf[2] == 'n' ? 1 : -1);
+			else if (!strncmp(&cmdbuf[1], "close", 5)) {
+				if (cmdbuf[6] == ' ')
+					session_destroy(atoi(&cmdbuf[7]));
+				else if (s)
+					session_destroy(s->s_slot);
+			}
 			else if (os && !strncmp(&cmdbuf[1], "s ", 2)) {
-				obbysess_enqueue_command(os, "%s\n",
+				obbysess_enqueue_command(os,
+						OBBY_PRIO_INTERACTIVE, "%s\n",
 						&cmdbuf[3]);
 			} else if (!strncmp(&cmdbuf[1], "nick ", 5)) {
 				free(G.nick);
@@ -43,7 +67,66 @@ void cmd_execute(char *cmdbuf, void *d)
 				free(G.color);
 				G.color = strdup(&cmdbuf[7]);
 			} else if (os && !strncmp(&cmdbuf[1], "subscribe ", 10)) {
-				obbysess_subscribe(os, &cmdbuf[11]);
+				if (obbysess_subscribe(os, &cmdbuf[11]))
+					__dbgout("can't subscribe to %s: %s\n",
+							&cmdbuf[11],
+							strerror(errno));
+			} else if (!strncmp(&cmdbuf[1], "find ", 5) ||
+					!strncmp(&cmdbuf[1], "regex ", 6)) {
+				int re = cmdbuf[1] == 'r';
+				int n;
+
+				n = search_create(texted, &cmdbuf[re ? 7 : 6], re);
+				if (n < 0)
+					__dbgout("bad pattern: %s\n", &cmdbuf[1]);
+				else
+					__dbgout("%d matches\n", n);
+			} else if (!strcmp(&cmdbuf[1], "n") ||
+					!strcmp(&cmdbuf[1], "N")) {
+				int n = search_jump(texted,
+						cmdbuf[1] == 'n' ? 1 : -1);
+
+				if (n < 0)
+					__dbgout("no matches\n");
+				else {
+					editor_view_show(texted,
+							texted->e_curline);
+					__dbgout("match %d/%u at %u:%u\n",
+							n + 1,
+							search_count(texted),
+							texted->e_curline + 1,
+							texted->e_curpos + 1);
+				}
+			} else if (!strncmp(&cmdbuf[1], "save ", 5)) {
+				char *path = strchr(&cmdbuf[6], ' ');
+
+				if (path) {
+					*path++ = '\0';
+					doc_save(&cmdbuf[6], path);
+				} else
+					__dbgout("usage: :save <document> "
+							"<path>\n");
+			} else if (os && !strncmp(&cmdbuf[1], "upload ", 7)) {
+				char *path = &cmdbuf[8], *name;
+
+				/* named after the file, unless told otherwise */
+				name = strchr(path, ' ');
+				if (name)
+					*name++ = '\0';
+				else
+					name = basename(path);
+
+				if (obbysess_upload(os, path, name))
+					__dbgout("can't upload %s: %s\n", path,
+							strerror(errno));
+			} else if (!strcmp(&cmdbuf[1], "view"))
+				view_toggle();
+			else if (!strncmp(&cmdbuf[1], "history", 7)) {
+				unsigned long page = 1;
+
+				if (cmdbuf[8] == ' ')
+					page = strtoul(&cmdbuf[9], NULL, 10);
+				chat_page(s, page);
 			} else if (
 					!strncmp(&cmdbuf[1], "connect ", 7) ||
 					!strncmp(&cmdbuf[1], "connect ", 8)
@@ -60,6 +143,7 @@ void cmd_execute(char *cmdbuf, void *d)
 
 		case '/':
 			__dbgout("got pattern: %s\n", &cmdbuf[1]);
+			chat_search(s, &cmdbuf[1]);
 			break;
 	}
 
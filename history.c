@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "curses.h"
+#include "nobby-ui.h"
+
+/*
+ * Chat history: an append-only store of chat lines, split into blocks
+ * of CHATHIST_BLOCK messages. Each block keeps its text in a single
+ * arena and a bloom filter of all the byte trigrams found in it, so a
+ * search only has to memmem() through the blocks that can possibly
+ * contain the pattern. Once the history is full, whole blocks are
+ * dropped from the oldest end.
+ */
+#define CHATHIST_BLOCK 256
+#define CHATHIST_BLOOM_BITS 8192
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+struct chatblock {
+	unsigned long cb_bloom[CHATHIST_BLOOM_BITS / BITS_PER_LONG];
+	unsigned cb_nmsgs;
+	size_t cb_used;
+	size_t cb_size;
+	char *cb_text;
+	size_t cb_off[CHATHIST_BLOCK + 1];
+};
+
+struct chathist {
+	struct chatblock **ch_blocks;	/* ring of ch_maxblocks */
+	unsigned ch_maxblocks;
+	unsigned ch_first;		/* oldest block in the ring */
+	unsigned ch_nblocks;
+	unsigned long ch_base;		/* seq of the first message kept */
+	unsigned long ch_next;		/* seq of the next message */
+};
+
+static inline unsigned __trigram(const unsigned char *p)
+{
+	return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U) >> 19;
+}
+
+static void __bloom_add(struct chatblock *cb, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned h;
+	size_t i;
+
+	for (i = 0; i + 2 < len; i++) {
+		h = __trigram(p + i);
+		cb->cb_bloom[h / BITS_PER_LONG] |= 1UL << (h % BITS_PER_LONG);
+	}
+}
+
+static int __bloom_test(struct chatblock *cb, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned h;
+	size_t i;
+
+	for (i = 0; i + 2 < len; i++) {
+		h = __trigram(p + i);
+		if (!(cb->cb_bloom[h / BITS_PER_LONG] &
+					(1UL << (h % BITS_PER_LONG))))
+			return 0;
+	}
+
+	return 1;
+}
+
+struct chathist *chathist_create(unsigned long maxmsgs)
+{
+	struct chathist *ch;
+
+	ch = malloc(sizeof(struct chathist));
+	if (!ch)
+		return NULL;
+
+	ch->ch_maxblocks = (maxmsgs + CHATHIST_BLOCK - 1) / CHATHIST_BLOCK;
+	if (!ch->ch_maxblocks)
+		ch->ch_maxblocks = 1;
+
+	ch->ch_blocks = calloc(ch->ch_maxblocks, sizeof(struct chatblock *));
+	if (!ch->ch_blocks) {
+		free(ch);
+		return NULL;
+	}
+
+	ch->ch_first = 0;
+	ch->ch_nblocks = 0;
+	ch->ch_base = 0;
+	ch->ch_next = 0;
+
+	return ch;
+}
+
+static void chatblock_free(struct chatblock *cb)
+{
+	free(cb->cb_text);
+	free(cb);
+}
+
+void chathist_destroy(struct chathist *ch)
+{
+	unsigned i;
+
+	for (i = 0; i < ch->ch_nblocks; i++)
+		chatblock_free(ch->ch_blocks[(ch->ch_first + i) %
+				ch->ch_maxblocks]);
+
+	free(ch->ch_blocks);
+	free(ch);
+}
+
+static struct chatblock *__block(struct chathist *ch, unsigned n)
+{
+	return ch->ch_blocks[(ch->ch_first + n) % ch->ch_maxblocks];
+}
+
+/*
+ * Get a block with room for another message, recycling the oldest one
+ * if the history is at its limit
+ */
+static struct chatblock *chathist_tail(struct chathist *ch)
+{
+	struct chatblock *cb = NULL;
+
+	if (ch->ch_nblocks) {
+		cb = __block(ch, ch->ch_nblocks - 1);
+		if (cb->cb_nmsgs < CHATHIST_BLOCK)
+			return cb;
+	}
+
+	if (ch->ch_nblocks == ch->ch_maxblocks) {
+		cb = ch->ch_blocks[ch->ch_first];
+		ch->ch_base += cb->cb_nmsgs;
+		ch->ch_first = (ch->ch_first + 1) % ch->ch_maxblocks;
+		ch->ch_nblocks--;
+	} else {
+		cb = malloc(sizeof(struct chatblock));
+		if (!cb)
+			return NULL;
+
+		cb->cb_text = NULL;
+		cb->cb_size = 0;
+	}
+
+	memset(cb->cb_bloom, 0, sizeof(cb->cb_bloom));
+	cb->cb_nmsgs = 0;
+	cb->cb_used = 0;
+	cb->cb_off[0] = 0;
+
+	ch->ch_blocks[(ch->ch_first + ch->ch_nblocks++) % ch->ch_maxblocks] =
+		cb;
+
+	return cb;
+}
+
+/*
+ * Append a message to the history; returns its sequence number or -1
+ */
+long chathist_append(struct chathist *ch, const char *msg)
+{
+	struct chatblock *cb;
+	size_t len = strlen(msg);
+
+	cb = chathist_tail(ch);
+	if (!cb)
+		return -1;
+
+	if (cb->cb_used + len > cb->cb_size) {
+		size_t size = cb->cb_size ? cb->cb_size : 4096;
+		char *text;
+
+		while (size < cb->cb_used + len)
+			size *= 2;
+
+		text = realloc(cb->cb_text, size);
+		if (!text)
+			return -1;
+
+		cb->cb_text = text;
+		cb->cb_size = size;
+	}
+
+	memcpy(cb->cb_text + cb->cb_used, msg, len);
+	__bloom_add(cb, msg, len);
+	cb->cb_used += len;
+	cb->cb_off[++cb->cb_nmsgs] = cb->cb_used;
+
+	return ch->ch_next++;
+}
+
+unsigned long chathist_first(struct chathist *ch)
+{
+	return ch->ch_base;
+}
+
+unsigned long chathist_next(struct chathist *ch)
+{
+	return ch->ch_next;
+}
+
+/*
+ * Look up message @seq; the text is not NUL-terminated
+ */
+const char *chathist_get(struct chathist *ch, unsigned long seq, size_t *len)
+{
+	unsigned long n = seq - ch->ch_base;
+	struct chatblock *cb;
+	unsigned b;
+
+	if (seq < ch->ch_base || seq >= ch->ch_next)
+		return NULL;
+
+	/* all blocks but the last one are full */
+	b = n / CHATHIST_BLOCK;
+	n %= CHATHIST_BLOCK;
+	cb = __block(ch, b);
+
+	*len = cb->cb_off[n + 1] - cb->cb_off[n];
+	return cb->cb_text + cb->cb_off[n];
+}
+
+/*
+ * Search for @pat in messages older than @before, newest first,
+ * calling @fn for each match until it returns non-zero; returns the
+ * number of matches reported
+ */
+long chathist_search(struct chathist *ch, const char *pat,
+		unsigned long before, chathist_match_fn_t fn, void *priv)
+{
+	size_t plen = strlen(pat), len;
+	struct chatblock *cb;
+	long found = 0;
+	const char *p;
+	int b, n;
+
+	if (!plen)
+		return 0;
+
+	if (before > ch->ch_next)
+		before = ch->ch_next;
+
+	for (b = ch->ch_nblocks - 1; b >= 0; b--) {
+		unsigned long seq0 = ch->ch_base + b * CHATHIST_BLOCK;
+
+		if (seq0 >= before)
+			continue;
+
+		cb = __block(ch, b);
+		if (!__bloom_test(cb, pat, plen))
+			continue;
+
+		/* cheap check over the whole arena before going per message */
+		if (!memmem(cb->cb_text, cb->cb_used, pat, plen))
+			continue;
+
+		for (n = cb->cb_nmsgs - 1; n >= 0; n--) {
+			if (seq0 + n >= before)
+				continue;
+
+			p = cb->cb_text + cb->cb_off[n];
+			len = cb->cb_off[n + 1] - cb->cb_off[n];
+			if (!memmem(p, len, pat, plen))
+				continue;
+
+			found++;
+			if (fn(priv, seq0 + n, p, len))
+				return found;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <iconv.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+
+/*
+ * Documents that aren't UTF-8 have their text converted on its way in,
+ * sync chunks and inserts alike, so that everything past this point only
+ * ever sees UTF-8. Opening an iconv descriptor is far from cheap, so
+ * there is one per encoding per session, opened the first time a
+ * document says it uses it and shared by every document that does; the
+ * output goes to a buffer that belongs to the session and only ever
+ * grows. UTF-8 documents get none of this, their text is just checked.
+ *
+ * A character may be split across two sync chunks; what's left of it
+ * at the end of one is kept in the document and glued to the start of
+ * the next.
+ */
+struct obbyconv {
+	obbyatom_t oc_enc;
+	iconv_t oc_cd;		/* (iconv_t)-1 if iconv doesn't know it */
+	int oc_sbcs;		/* one byte is one character */
+	struct obbydoc *oc_owner; /* whose shift state oc_cd holds */
+	struct obbyconv *oc_next;
+};
+
+/*
+ * Is every byte of the encoding a character of its own? That's what
+ * lets positions in the document be mapped to the converted text.
+ */
+static int __sbcs(iconv_t cd)
+{
+	char c, out[16], *in, *o;
+	size_t inleft, outleft;
+	int i, ret = 1;
+
+	for (i = 1; i < 256 && ret; i++) {
+		c = i;
+		in = &c;
+		inleft = 1;
+		o = out;
+		outleft = sizeof(out);
+
+		/* a byte that needs more after it: a multibyte encoding */
+		if (iconv(cd, &in, &inleft, &o, &outleft) == (size_t)-1 &&
+				errno == EINVAL)
+			ret = 0;
+
+		iconv(cd, NULL, NULL, NULL, NULL);
+	}
+
+	return ret;
+}
+
+static struct obbyconv *__open(struct obbysess *os, obbyatom_t enc)
+{
+	struct obbyconv *oc;
+
+	oc = malloc(sizeof(struct obbyconv));
+	if (!oc)
+		return NULL;
+
+	oc->oc_enc = enc;
+	oc->oc_cd = iconv_open("UTF-8", obby_atom_name(os, enc));
+	oc->oc_sbcs = oc->oc_cd != (iconv_t)-1 && __sbcs(oc->oc_cd);
+	oc->oc_owner = NULL;
+	oc->oc_next = os->os_convs;
+	os->os_convs = oc;
+
+	return oc;
+}
+
+/*
+ * Set @od's encoding and the conversion its text needs; an encoding that
+ * iconv doesn't know is treated as UTF-8. Returns -1 if out of memory.
+ */
+int obbydoc_set_encoding(struct obbysess *os, struct obbydoc *od,
+		obbyatom_t enc)
+{
+	struct obbyconv *oc;
+
+	od->od_encoding = (char *)obby_atom_name(os, enc);
+	od->od_conv = NULL;
+	od->od_charpos = 0;
+	od->od_npartial = 0;
+
+	if (!strcasecmp(od->od_encoding, "UTF-8") ||
+			!strcasecmp(od->od_encoding, "UTF8"))
+		return 0;
+
+	for (oc = os->os_convs; oc; oc = oc->oc_next)
+		if (oc->oc_enc == enc)
+			break;
+
+	if (!oc) {
+		oc = __open(os, enc);
+		if (!oc)
+			return -1;
+	}
+
+	if (oc->oc_cd == (iconv_t)-1)
+		return 0;
+
+	od->od_conv = oc;
+	od->od_charpos = oc->oc_sbcs;
+
+	return 0;
+}
+
+void obbyconv_free_all(struct obbysess *os)
+{
+	struct obbyconv *oc;
+
+	while ((oc = os->os_convs)) {
+		os->os_convs = oc->oc_next;
+		if (oc->oc_cd != (iconv_t)-1)
+			iconv_close(oc->oc_cd);
+		free(oc);
+	}
+
+	free(os->os_convbuf);
+	os->os_convbuf = NULL;
+	os->os_convsize = 0;
+}
+
+/* a new stream of text for @od: forget anything left from the last one */
+void obbydoc_convert_reset(struct obbydoc *od)
+{
+	od->od_npartial = 0;
+	if (od->od_conv)
+		od->od_conv->oc_owner = NULL;
+}
+
+/* make the output buffer at least @size bytes */
+static int __room(struct obbysess *os, size_t size)
+{
+	char *buf;
+
+	if (size <= os->os_convsize)
+		return 0;
+
+	if (size < os->os_convsize * 2)
+		size = os->os_convsize * 2;
+
+	buf = realloc(os->os_convbuf, size);
+	if (!buf)
+		return -1;
+
+	os->os_convbuf = buf;
+	os->os_convsize = size;
+
+	return 0;
+}
+
+/*
+ * Convert as much of *@in as there is into the output buffer from
+ * *@used on; bytes that aren't valid in the encoding become '?'. Stops
+ * at the end of the input or at a character that is cut short, which
+ * *@inleft then still holds. Returns -1 if out of memory.
+ */
+static int __run(struct obbysess *os, iconv_t cd, char **in, size_t *inleft,
+		size_t *used)
+{
+	size_t outleft;
+	char *out;
+
+	for (;;) {
+		/* keeping a byte spare for the terminating NUL */
+		if (__room(os, *used + *inleft * 4 + 16))
+			return -1;
+
+		out = os->os_convbuf + *used;
+		outleft = os->os_convsize - *used - 1;
+		if (iconv(cd, in, inleft, &out, &outleft) != (size_t)-1) {
+			*used = out - os->os_convbuf;
+			return 0;
+		}
+
+		*used = out - os->os_convbuf;
+		switch (errno) {
+			case E2BIG:
+				if (__room(os, os->os_convsize * 2))
+					return -1;
+				break;
+
+			case EILSEQ:
+				os->os_convbuf[(*used)++] = '?';
+				os->os_stats.st_conv_errors++;
+				(*in)++;
+				(*inleft)--;
+				break;
+
+			case EINVAL:
+				return 0;
+
+			default:
+				return -1;
+		}
+	}
+}
+
+/*
+ * Convert @len bytes of @text from @od's encoding. @more says that the
+ * text goes on in the next call, as sync chunks do; otherwise a
+ * character cut short at the end is bad input like any other. Returns
+ * the NUL-terminated UTF-8, which stays valid until the next call, or
+ * NULL if out of memory.
+ *
+ * XXX: documents sharing a stateful encoding (ISO-2022-*) lose their
+ * shift state to each other if their chunks interleave
+ */
+char *obbydoc_convert(struct obbysess *os, struct obbydoc *od,
+		const char *text, size_t len, int more)
+{
+	struct obbyconv *oc = od->od_conv;
+	char tmp[sizeof(od->od_partial) * 2], *in;
+	size_t used = 0, left, n, take, done;
+
+	if (oc->oc_owner != od) {
+		iconv(oc->oc_cd, NULL, NULL, NULL, NULL);
+		oc->oc_owner = od;
+	}
+
+	os->os_stats.st_conv_bytes += len;
+
+	/* finish off the character the last chunk ended in the middle of */
+	if (od->od_npartial) {
+		n = od->od_npartial;
+		take = len < sizeof(tmp) - n ? len : sizeof(tmp) - n;
+		memcpy(tmp, od->od_partial, n);
+		memcpy(tmp + n, text, take);
+
+		in = tmp;
+		left = n + take;
+		if (__run(os, oc->oc_cd, &in, &left, &used))
+			return NULL;
+
+		done = n + take - left;
+		od->od_npartial = 0;
+		if (done < n) {
+			/* still not complete: wait for more, or give up */
+			if (more && take == len &&
+					left <= sizeof(od->od_partial)) {
+				memcpy(od->od_partial, in, left);
+				od->od_npartial = left;
+				goto out;
+			}
+
+			os->os_convbuf[used++] = '?';
+			os->os_stats.st_conv_errors++;
+			done = n;
+		}
+
+		text += done - n;
+		len -= done - n;
+	}
+
+	in = (char *)text;
+	left = len;
+	if (__run(os, oc->oc_cd, &in, &left, &used))
+		return NULL;
+
+	if (left) {
+		if (more && left <= sizeof(od->od_partial)) {
+			memcpy(od->od_partial, in, left);
+			od->od_npartial = left;
+		} else {
+			os->os_convbuf[used++] = '?';
+			os->os_stats.st_conv_errors++;
+		}
+	}
+
+out:
+	os->os_convbuf[used] = 0;
+
+	return os->os_convbuf;
+}
@@ -13,89 +13,417 @@ struct editor *editor_create(WINDOW *win, void *priv)
 		return NULL;
 
 	e->e_win = win;
-	e->e_buf = NULL;
+	e->e_text = NULL;
 	e->e_lines = 0;
 	e->e_curline = -1;
 	e->e_curpos = 0;
 	e->e_priv = priv;
+	e->e_search = NULL;
+	e->e_line = NULL;
+	e->e_linesz = 0;
+	e->e_top = 0;
+	e->e_rows = 0;
+	e->e_dirty = NULL;
+	e->e_width = NULL;
+	e->e_undo = NULL;
 
 	return e;
 }
 
 void editor_destroy(struct editor *e)
 {
-	if (e->e_buf)
-		free(e->e_buf);
-
+	if (e->e_search)
+		search_destroy(e);
+
+	editor_clear(e);
+	free(e->e_line);
+	free(e->e_dirty);
+	editor_width_free(e);
+	if (e->e_undo)
+		edundo_destroy(e->e_undo);
 	free(e);
 }
 
-#define MAXLINES 16384
+/*
+ * Let whoever indexes the buffer know that lines [@line, @line + @old)
+ * have been replaced with lines [@line, @line + @new)
+ */
+static void editor_changed(struct editor *e, unsigned line, unsigned old,
+		unsigned new)
+{
+	editor_width_changed(e, line, old, new);
+
+	if (e->e_search)
+		search_update(e, line, old, new);
+
+	editor_view_changed(e, line, old, new);
+}
+
+/* replace the text with the result of a rope operation */
+static int editor_settext(struct editor *e, struct rope *r, int err)
+{
+	if (err)
+		return -1;
+
+	rope_put(e->e_text);
+	e->e_text = r;
+	e->e_lines = rope_newlines(r) + 1;
+
+	return 0;
+}
+
+/* whose change it is, as far as the undo log goes */
+enum {
+	EDBY_REMOTE = 0,
+	EDBY_LOCAL,
+	EDBY_UNDO,	/* logged already */
+};
+
+/* all changes to the text go through these two, and into the undo log */
+static int __rope_insert(struct editor *e, size_t off, const char *buf,
+		size_t len, int by)
+{
+	struct rope *r;
+	int err;
+
+	r = rope_insert(e->e_text, off, buf, len, &err);
+	if (editor_settext(e, r, err))
+		return -1;
+
+	if (e->e_undo && by != EDBY_UNDO)
+		edundo_insert(e->e_undo, off, buf, len, by == EDBY_LOCAL);
+
+	return 0;
+}
+
+static int __rope_delete(struct editor *e, size_t off, size_t len, int by)
+{
+	struct rope *r;
+	int err;
+
+	if (e->e_undo && by != EDBY_UNDO)
+		edundo_delete(e->e_undo, e->e_text, off, len,
+				by == EDBY_LOCAL);
+
+	r = rope_delete(e->e_text, off, len, &err);
+	if (editor_settext(e, r, err)) {
+		if (e->e_undo)
+			edundo_clear(e->e_undo);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __undo_break(struct editor *e)
+{
+	if (e->e_undo)
+		edundo_break(e->e_undo);
+}
+
+void editor_clear(struct editor *e)
+{
+	unsigned old = e->e_lines;
+
+	rope_put(e->e_text);
+	e->e_text = NULL;
+	e->e_lines = 0;
+	e->e_curline = -1;
+	e->e_curpos = 0;
+	if (e->e_undo)
+		edundo_clear(e->e_undo);
+
+	editor_changed(e, 0, old, 0);
+}
+
+/*
+ * A reference to the text as it is now, which later edits won't touch;
+ * rope_put() it when done
+ */
+struct rope *editor_snapshot(struct editor *e)
+{
+	return rope_get(e->e_text);
+}
+
+static size_t __linestart(struct editor *e, unsigned line)
+{
+	return rope_line_start(e->e_text, line);
+}
+
+static size_t __linelen(struct editor *e, unsigned line)
+{
+	size_t start = __linestart(e, line);
+
+	if (line + 1 < e->e_lines)
+		return __linestart(e, line + 1) - 1 - start;
+
+	return rope_len(e->e_text) - start;
+}
+
+/*
+ * Copy of line @line, NUL-terminated; valid until the next call
+ */
+const char *editor_getline(struct editor *e, unsigned line, size_t *len)
+{
+	size_t n;
+
+	if (line >= e->e_lines)
+		return NULL;
+
+	n = __linelen(e, line);
+	if (n + 1 > e->e_linesz) {
+		char *p = realloc(e->e_line, n + 1);
+
+		if (!p)
+			return NULL;
+
+		e->e_line = p;
+		e->e_linesz = n + 1;
+	}
+
+	rope_copy(e->e_text, __linestart(e, line), n, e->e_line);
+	e->e_line[n] = 0;
+	if (len)
+		*len = n;
+
+	return e->e_line;
+}
+
 /*
  * Change number of lines in editor's buffer by @delta
  */
-int editor_realloclines(struct editor *e, int delta)
+static int editor_realloclines(struct editor *e, int delta)
 {
 	int lines = e->e_lines + delta;
-	int i;
+	unsigned old = e->e_lines;
+	size_t off;
+	char *nl;
+	int err;
 
-	if (lines < 0 || lines > MAXLINES)
+	if (lines < 0)
 		return -1;
 
-	if (e->e_buf && lines == e->e_lines)
+	if (lines == e->e_lines)
+		return lines;
+
+	if (!lines) {
+		editor_clear(e);
 		return 0;
+	}
+
+	if (lines < e->e_lines) {
+		off = __linestart(e, lines) - 1;
+		if (__rope_delete(e, off, rope_len(e->e_text) - off,
+					EDBY_LOCAL))
+			return -1;
+
+		editor_changed(e, lines, old - lines, 0);
+
+		return lines;
+	}
 
-	if (lines < e->e_lines)
-		for (i = lines; i < e->e_lines; i++)
-			if (e->e_buf[i])
-				free(e->e_buf[i]);
+	/* the first line of an empty buffer doesn't need a newline */
+	if (!e->e_lines)
+		delta--;
 
-	e->e_buf = realloc(e->e_buf, lines * sizeof(char *));
-	if (!e->e_buf)
+	nl = malloc(delta);
+	if (!nl)
 		return -1;
 
-	if (lines > e->e_lines)
-		for (i = e->e_lines; i < lines; i++)
-			e->e_buf[i] = NULL;
+	memset(nl, '\n', delta);
+	err = __rope_insert(e, rope_len(e->e_text), nl, delta, EDBY_LOCAL);
+	free(nl);
+	if (err)
+		return -1;
 
-	e->e_lines = lines;
+	editor_changed(e, old, 0, lines - old);
 
 	return lines;
 }
 
+/*
+ * Replace whatever follows column @pos of line @line with @buf, adding
+ * lines as needed
+ */
 int editor_addline(struct editor *e, int line, int pos, char *buf, unsigned f)
 {
-	int minlen = pos + (buf ? strlen(buf) : 0) + 1;
+	size_t start, len;
 
 	/* check if the line exists */
-	if (!e->e_buf || line > e->e_lines - 1)
-		if (editor_realloclines(e, line - (e->e_lines - 1)) < 0)
+	if (line >= (int)e->e_lines)
+		if (editor_realloclines(e, line - e->e_lines + 1) < 0)
 			return -1;
 
-	if (!e->e_buf[line]) {
-		e->e_buf[line] = malloc(minlen);
-		if (!e->e_buf[line])
-			return -1;
+	start = __linestart(e, line);
+	len = __linelen(e, line);
+	if (pos > len)
+		pos = len;
 
-		memset(e->e_buf[line], 0, minlen);
-	} else {
-		int oldsz = strlen(e->e_buf[line]);
+	if (pos < len && __rope_delete(e, start + pos, len - pos, EDBY_LOCAL))
+		return -1;
 
-		e->e_buf[line] = realloc(e->e_buf[line],
-				pos > oldsz ? minlen
-				: oldsz + (buf ? strlen(buf) : 0) + 1);
-		if (!e->e_buf[line])
-			return -1;
-	}
+	if (buf && *buf && __rope_insert(e, start + pos, buf, strlen(buf),
+				EDBY_LOCAL))
+		return -1;
 
-	if (buf)
-		memcpy(e->e_buf[line] + pos, buf, strlen(buf) + 1);
-	else
-		e->e_buf[line][0] = 0;
+	if (e->e_curline == -1)
+		e->e_curline = 0;
+
+	editor_changed(e, line, 1, 1);
+
+	return 0;
+}
+
+/*
+ * Find line and column of byte offset @off in the text, which is the
+ * lines of the buffer joined with newlines; EDITOR_END means the end
+ */
+int editor_locate(struct editor *e, size_t off, unsigned *line,
+		unsigned *col)
+{
+	size_t l;
+
+	if (!e->e_lines)
+		return -1;
+
+	if (off == EDITOR_END)
+		off = rope_len(e->e_text);
+
+	if (off > rope_len(e->e_text))
+		return -1;
+
+	l = rope_line_of(e->e_text, off);
+	*line = l;
+	*col = off - __linestart(e, l);
+
+	return 0;
+}
+
+/*
+ * Byte offset of character @n of the text, for positions that count
+ * characters; -1 if there aren't that many
+ */
+size_t editor_charoff(struct editor *e, size_t n)
+{
+	return rope_char_offset(e->e_text, n);
+}
+
+static int __insert(struct editor *e, size_t off, const char *buf,
+		size_t len, int by)
+{
+	const char *p, *end = buf + len;
+	unsigned line, col, nl = 0;
+
+	if (!e->e_lines && editor_realloclines(e, 1) < 0)
+		return -1;
+
+	if (editor_locate(e, off, &line, &col))
+		return -1;
+
+	if (off == EDITOR_END)
+		off = rope_len(e->e_text);
+
+	for (p = buf; (p = memchr(p, '\n', end - p)); p++)
+		nl++;
+
+	if (__rope_insert(e, off, buf, len, by))
+		return -1;
 
 	if (e->e_curline == -1)
 		e->e_curline = 0;
 
+	editor_changed(e, line, 1, nl + 1);
+
+	return 0;
+}
+
+/*
+ * Insert @len bytes of @buf (which may contain newlines) at byte
+ * offset @off of the text
+ */
+int editor_insert(struct editor *e, size_t off, const char *buf, size_t len)
+{
+	return __insert(e, off, buf, len, EDBY_LOCAL);
+}
+
+/* the same, for a change someone else made, which we can't undo */
+int editor_remote_insert(struct editor *e, size_t off, const char *buf,
+		size_t len)
+{
+	return __insert(e, off, buf, len, EDBY_REMOTE);
+}
+
+static int __delete(struct editor *e, size_t off, size_t len, int by)
+{
+	unsigned l1, c1, l2, c2;
+
+	if (!len)
+		return 0;
+
+	if (editor_locate(e, off, &l1, &c1) ||
+			editor_locate(e, off + len, &l2, &c2))
+		return -1;
+
+	if (__rope_delete(e, off, len, by))
+		return -1;
+
+	if (e->e_curline >= e->e_lines)
+		e->e_curline = e->e_lines - 1;
+
+	editor_changed(e, l1, l2 - l1 + 1, 1);
+
+	return 0;
+}
+
+/*
+ * Delete @len bytes of the text starting at byte offset @off
+ */
+int editor_delete(struct editor *e, size_t off, size_t len)
+{
+	return __delete(e, off, len, EDBY_LOCAL);
+}
+
+int editor_remote_delete(struct editor *e, size_t off, size_t len)
+{
+	return __delete(e, off, len, EDBY_REMOTE);
+}
+
+/* keep an undo log of up to @max bytes */
+int editor_undo_enable(struct editor *e, size_t max)
+{
+	if (!e->e_undo)
+		e->e_undo = edundo_create(max);
+
+	return e->e_undo ? 0 : -1;
+}
+
+/*
+ * Undo (or with @redo, redo) our last change and put the cursor where
+ * it was; -1 if there's none left that others haven't changed the text
+ * of since
+ */
+int editor_undo(struct editor *e, int redo)
+{
+	unsigned line, col;
+	const char *text;
+	size_t off, len;
+	int ins;
+
+	if (!e->e_undo ||
+			edundo_step(e->e_undo, redo, &off, &len, &text, &ins) <= 0)
+		return -1;
+
+	if (ins ? __insert(e, off, text, len, EDBY_UNDO)
+			: __delete(e, off, len, EDBY_UNDO)) {
+		edundo_clear(e->e_undo);
+		return -1;
+	}
+
+	if (!editor_locate(e, ins ? off + len : off, &line, &col)) {
+		e->e_curline = line;
+		e->e_curpos = col;
+	}
+
 	return 0;
 }
 
@@ -115,89 +443,161 @@ int editor_addchunk(struct editor *e, int line, int pos, char *buf, unsigned f)
 	return strlen(buf);
 }
 
+/*
+ * Delete @len bytes (-1 for all) from column @pos of line @line
+ */
 int editor_killline(struct editor *e, int line, int pos, ssize_t len)
 {
-	int sz;
+	size_t start, linelen;
 
-	if (line > e->e_lines)
+	if (line >= e->e_lines)
 		return -1;
 
-	if (!e->e_buf[line])
+	start = __linestart(e, line);
+	linelen = __linelen(e, line);
+	if (pos >= linelen)
 		return 0;
 
-	if (line == e->e_lines) {
-		editor_realloclines(e, -1);
-		return 0;
-	}
+	if (len == -1 || pos + len > linelen)
+		len = linelen - pos;
 
-	if (len == -1) {
-		free(e->e_buf[line]);
-		e->e_buf[line] = NULL;
-		return 0;
-	}
+	if (__rope_delete(e, start + pos, len, EDBY_LOCAL))
+		return -1;
 
-	sz = strlen(e->e_buf[line]) - pos - len + 1;
-	memmove(e->e_buf[line] + pos, e->e_buf[line] + pos + len, sz);
-	e->e_buf[line][pos + sz] = 0;
-	e->e_buf[line] = realloc(e->e_buf[line], pos + sz);
+	editor_changed(e, line, 1, 1);
 
 	return 0;
 }
 
+/* redraw the current line, for single line editors */
+static void editor_drawline(struct editor *e)
+{
+	const char *line = editor_getline(e, e->e_curline, NULL);
+
+	werase(e->e_win);
+	/* XXX: e: first displayed line */
+	if (line)
+		waddstr(e->e_win, line);
+	wmove(e->e_win, 0, editor_column(e, e->e_curline, e->e_curpos));
+}
+
+/* delete the character before the cursor, combining marks and all */
 void editor_backspace(struct editor *e)
 {
-	if (!e->e_buf[e->e_curline] || !e->e_curpos)
+	unsigned pos;
+
+	if (e->e_curline >= e->e_lines || !e->e_curpos)
 		return;
 
-	e->e_buf[e->e_curline][--e->e_curpos] = 0;
+	pos = editor_stepchar(e, e->e_curline, e->e_curpos, -1);
+	editor_killline(e, e->e_curline, pos, e->e_curpos - pos);
+	e->e_curpos = pos;
 
-	werase(e->e_win);
-	/* XXX: e: first displayed line */
-	waddstr(e->e_win, e->e_buf[e->e_curline]);
+	editor_drawline(e);
 }
 
 void editor_clearline(struct editor *e)
 {
-	if (!e->e_buf[e->e_curline] || !e->e_curpos)
+	if (e->e_curline >= e->e_lines || !e->e_curpos)
 		return;
 
+	__undo_break(e);
 	e->e_curpos = 0;
-	memset(e->e_buf[e->e_curline], 0, strlen(e->e_buf[e->e_curline]));
+	editor_killline(e, e->e_curline, 0, -1);
 
 	werase(e->e_win); /* XXX: if needed */
 }
 
 void editor_killword(struct editor *e)
 {
-	char *s, *line = e->e_buf[e->e_curline];
+	const char *line;
+	size_t len;
 	int pos = e->e_curpos;
 
+	line = editor_getline(e, e->e_curline, &len);
 	if (!line || !pos)
 		return;
 
+	if (pos > len)
+		pos = len;
+
 	/* cut all trailing whitespace first */
-	for (;
-		pos > 0
-		&& isspace(line[pos - 1]);
-		line[--pos] = 0
-	    );
+	while (pos > 0 && isspace((unsigned char)line[pos - 1]))
+		pos--;
 
 	/* then, cut the last word */
-	s = strrchr(line, ' ');
-	if (s) {
-		pos = s - line + 1;
-		line[pos] = 0;
-		werase(e->e_win);
-		waddstr(e->e_win, line);
-	} else
-		editor_clearline(e);
+	while (pos > 0 && line[pos - 1] != ' ')
+		pos--;
 
+	__undo_break(e);
+	editor_killline(e, e->e_curline, pos, e->e_curpos - pos);
 	e->e_curpos = pos;
+
+	editor_drawline(e);
+}
+
+/* move the cursor one character left (@dir < 0) or right */
+static void editor_movechar(struct editor *e, int dir)
+{
+	if (e->e_curline >= e->e_lines)
+		return;
+
+	__undo_break(e);
+	e->e_curpos = editor_stepchar(e, e->e_curline, e->e_curpos, dir);
+	wmove(e->e_win, 0, editor_column(e, e->e_curline, e->e_curpos));
+}
+
+/*
+ * Insert @len bytes of input at the cursor; the screen is refreshed by
+ * whoever reads the input, once there's none left
+ */
+void editor_putstr(struct editor *e, const char *buf, size_t len)
+{
+	size_t linelen;
+
+	if (e->e_curline >= e->e_lines || !len ||
+			editor_insert(e, __linestart(e, e->e_curline) +
+				e->e_curpos, buf, len))
+		return;
+
+	e->e_curpos += len;
+
+	/* typing at the end of the line only needs to echo */
+	linelen = __linelen(e, e->e_curline);
+	if (e->e_curpos == linelen)
+		waddnstr(e->e_win, buf, len);
+	else
+		editor_drawline(e);
+}
+
+/*
+ * The same, for a paste, which is undone on its own; being a single
+ * line, the command line gets spaces for line breaks and tabs in it and
+ * no other control characters at all. @buf is changed in place.
+ */
+void editor_paste(struct editor *e, char *buf, size_t len)
+{
+	size_t i, n = 0;
+	char c;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c == '\n' || c == '\r' || c == '\t')
+			c = ' ';
+		else if ((unsigned char)c < ' ' || c == 0x7f)
+			continue;
+
+		buf[n++] = c;
+	}
+
+	__undo_break(e);
+	editor_putstr(e, buf, n);
+	__undo_break(e);
 }
 
 int editor_gotchar(struct editor *e, int ch)
 {
-	char s[] = { ch, 0 };
+	char *cmd, c;
 
 	if (e->e_curline == -1)
 		return -1;
@@ -210,18 +610,40 @@ int editor_gotchar(struct editor *e, int ch)
 			G.state = NSTATE_LEAVING;
 			break;
 
+		case KEY_F(2):
+			view_toggle();
+			break;
+
+		case KEY_NPAGE:
+		case KEY_PPAGE:
+			editor_scroll(texted, (ch == KEY_NPAGE ? 1 : -1) *
+					(int)(texted->e_rows - 1));
+			break;
+
 		case '\n':
 		case '\r':
 		case KEY_ENTER:
 			waddch(e->e_win, ch);
-			cmd_execute(e->e_buf[e->e_curline], e->e_priv);
+			cmd = strdup(editor_getline(e, e->e_curline, NULL) ?: "");
+			if (cmd) {
+				cmd_execute(cmd, e->e_priv);
+				free(cmd);
+			}
 			editor_clearline(e);
+			/* every command line has a history of its own */
+			if (e->e_undo)
+				edundo_clear(e->e_undo);
 			break;
 
 		case KEY_BACKSPACE:
 			editor_backspace(e);
 			break;
 
+		case KEY_LEFT:
+		case KEY_RIGHT:
+			editor_movechar(e, ch == KEY_LEFT ? -1 : 1);
+			break;
+
 		case 0x17: /* ^W */
 			editor_killword(e);
 			break;
@@ -230,15 +652,24 @@ int editor_gotchar(struct editor *e, int ch)
 			editor_clearline(e);
 			break;
 
+		case 0x1f: /* ^_ */
+		case 0x12: /* ^R */
+			if (editor_undo(e, ch == 0x12))
+				beep();
+			editor_drawline(e);
+			break;
+
 	case 0x0c: /* ^L */
 		case KEY_RESIZE:
 			screen_resize();
 			break;
 
 		default:
-			waddch(e->e_win, ch);
-			wrefresh(e->e_win);
-			editor_addline(e, e->e_curline, e->e_curpos++, s, 0);
+			/* bytes only; multibyte characters come one by one */
+			if (ch >= 0 && ch <= 0xff) {
+				c = ch;
+				editor_putstr(e, &c, 1);
+			}
 			break;
 	}
 
@@ -0,0 +1,697 @@
+/*
+ * nobby-loadgen: load generator for obby servers, built on libcobby.
+ *
+ * Simulates a crowd of users: each client is a session of its own that
+ * logs in, subscribes to a document and then chats and edits at random
+ * intervals around the rates it's been given. Clients are spread over
+ * a few worker threads, each with an epoll set and a timer wheel of its
+ * own, which is what cobby.h asks of sessions used from several threads.
+ *
+ * What gets measured is what a client sees: the time from connecting
+ * to being synced, and how long it takes for a chat message to come back
+ * from the server to the client that sent it. Every client counts the
+ * chat messages and edits it receives too, which is the server's fan-out.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+
+static const char my_name[] = "nobby-loadgen";
+
+/* how often progress is reported, and how many epoll events at a time */
+#define LG_REPORT_MS 1000
+#define LG_EVENTS 256
+
+struct lgconf {
+	const char *host;
+	const char *service;
+	const char *nick;
+	const char *doc;
+	int clients;
+	int threads;
+	unsigned duration;	/* s */
+	unsigned ramp;		/* connections per second */
+	double chat_rate;	/* per client per second */
+	double edit_rate;
+};
+
+static struct lgconf conf = {
+	.nick		= "lg",
+	.clients	= 100,
+	.threads	= 1,
+	.duration	= 10,
+	.ramp		= 100,
+	.chat_rate	= 0.2,
+	.edit_rate	= 1.0,
+};
+
+/*
+ * Counters a worker bumps and the main thread reads while it runs,
+ * hence the atomics; histograms are only looked at once the workers
+ * are done
+ */
+struct lgstats {
+	unsigned long ls_started;
+	unsigned long ls_synced;
+	unsigned long ls_failed;
+	unsigned long ls_disconnects;
+	unsigned long ls_chats_out;
+	unsigned long ls_chats_in;
+	unsigned long ls_edits_out;
+	unsigned long ls_edits_in;
+	unsigned long ls_edit_records;	/* what the edits went out as */
+	unsigned long ls_bytes_in;
+	unsigned long ls_bytes_out;
+};
+
+#define LG_INC(__w, __f, __n) \
+	__atomic_fetch_add(&(__w)->w_stats.__f, __n, __ATOMIC_RELAXED)
+#define LG_GET(__w, __f) \
+	__atomic_load_n(&(__w)->w_stats.__f, __ATOMIC_RELAXED)
+
+struct worker;
+
+struct client {
+	struct obbysess *c_os;
+	struct worker *c_w;
+	int c_id;
+	int c_sock;		/* what the epoll set has, -1 if nothing */
+	int c_synced;
+	char c_nick[32];
+	char *c_doc;		/* the document we edit, once subscribed */
+	unsigned long c_doclen;	/* as far as we can tell */
+	unsigned long c_cursor;	/* where we typed last */
+	unsigned c_seq;
+	unsigned long long c_start;	/* ns, when we connected */
+	struct obbytimer c_chat_timer;
+	struct obbytimer c_edit_timer;
+};
+
+struct worker {
+	pthread_t w_thread;
+	int w_epfd;
+	struct obbywheel w_wheel;
+	struct obbytimer w_ramp_timer;
+	unsigned long long w_ramp_start;	/* ms */
+	struct client *w_clients;
+	int w_nclients;
+	int w_nstarted;
+	unsigned w_seed;
+
+	struct lgstats w_stats;
+	struct obbyhist w_login;
+	struct obbyhist w_chat_rtt;
+};
+
+static int stop;
+
+/* around @rate times a second: anywhere from half to one and a half */
+static unsigned long __interval(struct worker *w, double rate)
+{
+	double mean = 1000.0 / rate;
+
+	return mean / 2 + mean * (rand_r(&w->w_seed) % 1000) / 1000;
+}
+
+static void __watch(struct client *c)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = c,
+	};
+
+	c->c_sock = c->c_os->os_sock;
+	if (c->c_sock == -1)
+		return;
+
+	if (epoll_ctl(c->c_w->w_epfd, EPOLL_CTL_ADD, c->c_sock, &ev)) {
+		fprintf(stderr, "%s: epoll_ctl: %m\n", c->c_nick);
+		c->c_sock = -1;
+	}
+}
+
+static void __client_stop(struct client *c)
+{
+	obbytimer_cancel(&c->c_chat_timer);
+	obbytimer_cancel(&c->c_edit_timer);
+	c->c_synced = 0;
+}
+
+/* the session is beyond repair; leave it be */
+static void __client_fail(struct client *c)
+{
+	struct worker *w = c->c_w;
+
+	__client_stop(c);
+	if (c->c_sock != -1)
+		epoll_ctl(w->w_epfd, EPOLL_CTL_DEL, c->c_sock, NULL);
+	c->c_sock = -1;
+
+	LG_INC(w, ls_bytes_in, c->c_os->os_stats.st_bytes_in);
+	LG_INC(w, ls_bytes_out, c->c_os->os_stats.st_bytes_out);
+	LG_INC(w, ls_edit_records, c->c_os->os_stats.st_edit_records);
+	obbysess_destroy(c->c_os);
+	c->c_os = NULL;
+	free(c->c_doc);
+	c->c_doc = NULL;
+
+	LG_INC(w, ls_failed, 1);
+}
+
+static void __synced(struct client *c);
+
+static void client_do(struct client *c)
+{
+	do {
+		obbysess_do(c->c_os);
+	} while (OS_ISOK(c->c_os) && obbysess_pending(c->c_os));
+
+	if (!OS_ISOK(c->c_os))
+		__client_fail(c);
+	else if (!c->c_synced && c->c_os->os_state == OSSTATE_SYNCED)
+		__synced(c);
+}
+
+static void __chat(struct obbytimer *t, void *priv)
+{
+	struct client *c = priv;
+	struct worker *w = c->c_w;
+
+	if (!obbysess_enqueue_command(c->c_os, OBBY_PRIO_INTERACTIVE,
+				"obby_message:lg %d %u %llu\n", c->c_id,
+				c->c_seq, obby_clock_ns())) {
+		c->c_seq++;
+		LG_INC(w, ls_chats_out, 1);
+	}
+
+	/* which may find the session gone */
+	client_do(c);
+	if (c->c_synced)
+		obbytimer_arm(&w->w_wheel, t, __interval(w, conf.chat_rate));
+}
+
+static const char *const words[] = {
+	"x", "foo", "bar(baz);", "\n", "int i;\n", "\t", "/* comment */",
+};
+
+/*
+ * Type a word, mostly where the last one went, or backspace over a few
+ * bytes; now and then, move somewhere else in the document first
+ */
+static void __edit(struct obbytimer *t, void *priv)
+{
+	struct client *c = priv;
+	struct worker *w = c->c_w;
+	unsigned long pos, len;
+	const char *word;
+	int r = rand_r(&w->w_seed);
+
+	pos = c->c_cursor;
+	if (pos > c->c_doclen || r % 8 == 0)
+		pos = c->c_doclen ? r % (c->c_doclen + 1) : 0;
+
+	if (c->c_doclen > 64 && r % 3 == 0) {
+		len = 1 + r % 4;
+		if (pos < len)
+			pos = len;
+
+		obbysess_delete(c->c_os, c->c_doc, pos - len, len);
+		c->c_doclen -= len;
+		c->c_cursor = pos - len;
+	} else {
+		word = words[r % (sizeof(words) / sizeof(words[0]))];
+		obbysess_insert(c->c_os, c->c_doc, pos, word);
+		c->c_doclen += strlen(word);
+		c->c_cursor = pos + strlen(word);
+	}
+
+	LG_INC(w, ls_edits_out, 1);
+
+	client_do(c);
+	if (c->c_synced)
+		obbytimer_arm(&w->w_wheel, t, __interval(w, conf.edit_rate));
+}
+
+/* logged in and caught up with everything: start doing things */
+static void __synced(struct client *c)
+{
+	struct obbysess *os = c->c_os;
+	struct worker *w = c->c_w;
+
+	c->c_synced = 1;
+	if (c->c_start) {
+		obbyhist_record(&w->w_login, obby_clock_ns() - c->c_start);
+		c->c_start = 0;
+		LG_INC(w, ls_synced, 1);
+	}
+
+	/* after a reconnect, the session subscribes again by itself */
+	if (!c->c_doc) {
+		if (conf.doc)
+			c->c_doc = strdup(conf.doc);
+		else if (os->os_edocs && os->os_docs[0])
+			c->c_doc = strdup(os->os_docs[0]->od_name);
+
+		if (c->c_doc)
+			obbysess_subscribe(os, c->c_doc);
+	}
+
+	if (conf.chat_rate > 0)
+		obbytimer_arm(&w->w_wheel, &c->c_chat_timer,
+				__interval(w, conf.chat_rate));
+}
+
+static int client_event(void *priv, struct obbyevent *oe)
+{
+	struct client *c = priv;
+	struct worker *w = c->c_w;
+	unsigned long long sent;
+	unsigned seq;
+	int id;
+
+	switch (oe->oe_type) {
+		case OETYPE_CHAT_MESSAGE:
+			LG_INC(w, ls_chats_in, 1);
+			if (sscanf(oe->oe_message, "lg %d %u %llu", &id, &seq,
+						&sent) == 3 && id == c->c_id)
+				obbyhist_record(&w->w_chat_rtt,
+						obby_clock_ns() - sent);
+			break;
+
+		case OETYPE_DOC_OPEN:
+			if (!c->c_doc || strcmp(oe->oe_docname, c->c_doc))
+				break;
+
+			c->c_doclen = 0;
+			c->c_cursor = 0;
+			if (conf.edit_rate > 0)
+				obbytimer_arm(&w->w_wheel, &c->c_edit_timer,
+						__interval(w, conf.edit_rate));
+			break;
+
+		case OETYPE_DOC_GETCHUNK:
+			c->c_doclen += strlen(oe->oe_message);
+			break;
+
+		case OETYPE_DOC_INSERT:
+			LG_INC(w, ls_edits_in, 1);
+			c->c_doclen += oe->oe_length;
+			break;
+
+		case OETYPE_DOC_DELETE:
+			LG_INC(w, ls_edits_in, 1);
+			c->c_doclen -= oe->oe_length < c->c_doclen
+				? oe->oe_length : c->c_doclen;
+			break;
+
+		case OETYPE_DISCONNECT:
+			/* closing the socket took it out of the epoll set */
+			LG_INC(w, ls_disconnects, 1);
+			c->c_sock = -1;
+			__client_stop(c);
+			break;
+
+		case OETYPE_RECONNECT:
+			__watch(c);
+			break;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * XXX: connecting and the TLS handshake both block, which holds up
+ * the worker's other clients while they take
+ */
+static void client_start(struct worker *w, struct client *c)
+{
+	LG_INC(w, ls_started, 1);
+
+	c->c_start = obby_clock_ns();
+	c->c_os = obbysess_create(conf.host, conf.service, OSTYPE_CLIENT);
+	if (!c->c_os) {
+		LG_INC(w, ls_failed, 1);
+		return;
+	}
+
+	obbysess_set_notify_callback(c->c_os, client_event, c);
+	obbysess_set_timers(c->c_os, &w->w_wheel);
+	obbysess_join(c->c_os, c->c_nick, "00ff00");
+	__watch(c);
+}
+
+/* start as many clients as the ramp allows by now */
+static void __ramp(struct obbytimer *t, void *priv)
+{
+	struct worker *w = priv;
+	unsigned long long due;
+
+	due = (obby_clock_ms() - w->w_ramp_start) * conf.ramp /
+		(1000ULL * conf.threads) + 1;
+
+	while (w->w_nstarted < w->w_nclients && w->w_nstarted < due)
+		client_start(w, &w->w_clients[w->w_nstarted++]);
+
+	if (w->w_nstarted < w->w_nclients)
+		obbytimer_arm(&w->w_wheel, t, OBBYWHEEL_TICK_MS);
+}
+
+static void *worker_run(void *priv)
+{
+	struct worker *w = priv;
+	struct epoll_event evs[LG_EVENTS];
+	unsigned long long now;
+	int i, n;
+
+	w->w_ramp_start = obby_clock_ms();
+	obbywheel_init(&w->w_wheel, w->w_ramp_start);
+	obbytimer_init(&w->w_ramp_timer, __ramp, w);
+	__ramp(&w->w_ramp_timer, w);
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		now = obby_clock_ms();
+		obbywheel_run(&w->w_wheel, now);
+
+		n = epoll_wait(w->w_epfd, evs, LG_EVENTS,
+				obbywheel_timeout(&w->w_wheel, 100, now));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			client_do(evs[i].data.ptr);
+	}
+
+	for (i = 0; i < w->w_nstarted; i++) {
+		struct client *c = &w->w_clients[i];
+
+		if (!c->c_os)
+			continue;
+
+		__client_stop(c);
+		LG_INC(w, ls_bytes_in, c->c_os->os_stats.st_bytes_in);
+		LG_INC(w, ls_bytes_out, c->c_os->os_stats.st_bytes_out);
+		LG_INC(w, ls_edit_records,
+				c->c_os->os_stats.st_edit_records);
+		obbysess_destroy(c->c_os);
+		free(c->c_doc);
+	}
+
+	obbytimer_cancel(&w->w_ramp_timer);
+
+	return NULL;
+}
+
+static int worker_init(struct worker *w, int first, int n, unsigned seed)
+{
+	struct client *c;
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	w->w_seed = seed;
+	w->w_nclients = n;
+	w->w_clients = calloc(n ? n : 1, sizeof(struct client));
+	if (!w->w_clients)
+		return -1;
+
+	w->w_epfd = epoll_create1(0);
+	if (w->w_epfd == -1) {
+		free(w->w_clients);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		c = &w->w_clients[i];
+		c->c_w = w;
+		c->c_id = first + i;
+		c->c_sock = -1;
+		snprintf(c->c_nick, sizeof(c->c_nick), "%s%d", conf.nick,
+				c->c_id);
+		obbytimer_init(&c->c_chat_timer, __chat, c);
+		obbytimer_init(&c->c_edit_timer, __edit, c);
+	}
+
+	return 0;
+}
+
+/* sum of counter @__f over all workers */
+#define LG_SUM(__ws, __f) \
+	({ \
+		unsigned long __s = 0; \
+		int __i; \
+		for (__i = 0; __i < conf.threads; __i++) \
+			__s += LG_GET(&(__ws)[__i], __f); \
+		__s; \
+	})
+
+static void report_progress(struct worker *ws, unsigned secs,
+		struct lgstats *last)
+{
+	struct lgstats now = {
+		.ls_synced = LG_SUM(ws, ls_synced),
+		.ls_failed = LG_SUM(ws, ls_failed),
+		.ls_disconnects = LG_SUM(ws, ls_disconnects),
+		.ls_chats_out = LG_SUM(ws, ls_chats_out),
+		.ls_chats_in = LG_SUM(ws, ls_chats_in),
+		.ls_edits_out = LG_SUM(ws, ls_edits_out),
+		.ls_edits_in = LG_SUM(ws, ls_edits_in),
+	};
+
+	printf("%4us %6lu synced %4lu failed %4lu disconnects | chat/s "
+			"%7lu out %9lu in | edits/s %7lu out %9lu in\n", secs,
+			now.ls_synced, now.ls_failed, now.ls_disconnects,
+			now.ls_chats_out - last->ls_chats_out,
+			now.ls_chats_in - last->ls_chats_in,
+			now.ls_edits_out - last->ls_edits_out,
+			now.ls_edits_in - last->ls_edits_in);
+	fflush(stdout);
+
+	*last = now;
+}
+
+static void __show_hist(const char *name, struct obbyhist *h)
+{
+	printf("  %-10s %9lu %9llu %9llu %9llu %9llu %9llu\n", name,
+			h->h_count,
+			obbyhist_percentile(h, 50.0) / 1000,
+			obbyhist_percentile(h, 90.0) / 1000,
+			obbyhist_percentile(h, 99.0) / 1000,
+			obbyhist_percentile(h, 99.9) / 1000,
+			h->h_max / 1000);
+}
+
+static void report_summary(struct worker *ws, double secs)
+{
+	struct obbyhist login, rtt;
+	unsigned long n;
+	int i;
+
+	obbyhist_reset(&login);
+	obbyhist_reset(&rtt);
+	for (i = 0; i < conf.threads; i++) {
+		obbyhist_merge(&login, &ws[i].w_login);
+		obbyhist_merge(&rtt, &ws[i].w_chat_rtt);
+	}
+
+	printf("\nclients    %lu started, %lu synced, %lu failed, "
+			"%lu disconnects in %.1f s\n",
+			LG_SUM(ws, ls_started), LG_SUM(ws, ls_synced),
+			LG_SUM(ws, ls_failed), LG_SUM(ws, ls_disconnects),
+			secs);
+
+	n = LG_SUM(ws, ls_chats_out);
+	printf("chat       %lu sent (%.1f/s), ", n, n / secs);
+	n = LG_SUM(ws, ls_chats_in);
+	printf("%lu received (%.1f/s)\n", n, n / secs);
+
+	n = LG_SUM(ws, ls_edits_out);
+	printf("edits      %lu sent (%.1f/s) in %lu records, ", n, n / secs,
+			LG_SUM(ws, ls_edit_records));
+	n = LG_SUM(ws, ls_edits_in);
+	printf("%lu received (%.1f/s)\n", n, n / secs);
+
+	n = LG_SUM(ws, ls_bytes_out);
+	printf("bytes      %lu sent (%.1f kB/s), ", n, n / secs / 1024);
+	n = LG_SUM(ws, ls_bytes_in);
+	printf("%lu received (%.1f kB/s)\n", n, n / secs / 1024);
+
+	printf("\n  %-10s %9s %9s %9s %9s %9s %9s\n", "usecs", "count",
+			"p50", "p90", "p99", "p99.9", "max");
+	__show_hist("login", &login);
+	__show_hist("chat rtt", &rtt);
+}
+
+static const struct option options[] = {
+	{ "clients",            1, 0, 'c' },
+	{ "threads",            1, 0, 'j' },
+	{ "duration",           1, 0, 'd' },
+	{ "ramp",               1, 0, 'r' },
+	{ "chat-rate",          1, 0, 'm' },
+	{ "edit-rate",          1, 0, 'e' },
+	{ "nick",               1, 0, 'n' },
+	{ "document",           1, 0, 'D' },
+	{ "help",               0, 0, 'h' },
+	{ NULL,                 0, 0, 0   },
+};
+
+static const char *options_desc[] = {
+	"number of simulated clients (100)",
+	"number of worker threads (1)",
+	"seconds to run for (10)",
+	"new connections per second (100)",
+	"chat messages per client per second (0.2)",
+	"edits per client per second (1)",
+	"nickname prefix (lg)",
+	"document to edit (the first one there is)",
+	"print help message and exit",
+};
+
+static const char *optstr = "c:j:d:r:m:e:n:D:h";
+
+static void usage(const char *msg, int exit_code)
+{
+	int i;
+
+	if (msg)
+		fprintf(stderr, "Error: %s\n", msg);
+
+	fprintf(stderr, "Usage: %s [OPTIONS] host service\n"
+			"OPTIONS:\n", my_name);
+	for (i = 0; options[i].name; i++)
+		fprintf(stderr, "\t-%c, --%s\t%s\n",
+				options[i].val,
+				options[i].name,
+				options_desc[i]);
+
+	exit(exit_code);
+}
+
+int main(int argc, char **argv)
+{
+	struct lgstats last;
+	struct worker *ws;
+	unsigned long long t0, now, next;
+	unsigned secs = 0;
+	int c, i, first, n, loptidx;
+
+	for (;;) {
+		c = getopt_long(argc, argv, optstr, options, &loptidx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'c':
+				conf.clients = atoi(optarg);
+				break;
+
+			case 'j':
+				conf.threads = atoi(optarg);
+				break;
+
+			case 'd':
+				conf.duration = atoi(optarg);
+				break;
+
+			case 'r':
+				conf.ramp = atoi(optarg);
+				break;
+
+			case 'm':
+				conf.chat_rate = atof(optarg);
+				break;
+
+			case 'e':
+				conf.edit_rate = atof(optarg);
+				break;
+
+			case 'n':
+				conf.nick = optarg;
+				break;
+
+			case 'D':
+				conf.doc = optarg;
+				break;
+
+			case 'h':
+				usage(NULL, EXIT_SUCCESS);
+
+			default:
+				usage("invalid arguments", EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind < 2)
+		usage("too few arguments", EXIT_FAILURE);
+
+	conf.host = argv[optind++];
+	conf.service = argv[optind++];
+
+	if (conf.clients < 1 || conf.threads < 1 || !conf.ramp)
+		usage("need at least one client, thread and connection "
+				"per second", EXIT_FAILURE);
+
+	if (conf.threads > conf.clients)
+		conf.threads = conf.clients;
+
+	if (obby_init())
+		usage("can't initialize TLS", EXIT_FAILURE);
+
+	ws = calloc(conf.threads, sizeof(struct worker));
+	if (!ws) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	t0 = obby_clock_ms();
+	for (i = first = 0; i < conf.threads; i++, first += n) {
+		n = conf.clients / conf.threads +
+			(i < conf.clients % conf.threads);
+
+		if (worker_init(&ws[i], first, n, t0 ^ i) ||
+				pthread_create(&ws[i].w_thread, NULL,
+					worker_run, &ws[i])) {
+			perror("worker");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&last, 0, sizeof(last));
+	for (next = t0 + LG_REPORT_MS; secs < conf.duration;
+			next += LG_REPORT_MS) {
+		while ((now = obby_clock_ms()) < next)
+			usleep((next - now) * 1000);
+
+		report_progress(ws, ++secs, &last);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < conf.threads; i++) {
+		pthread_join(ws[i].w_thread, NULL);
+		close(ws[i].w_epfd);
+	}
+
+	report_summary(ws, (obby_clock_ms() - t0) / 1000.0);
+
+	for (i = 0; i < conf.threads; i++)
+		free(ws[i].w_clients);
+	free(ws);
+
+	obby_fini();
+
+	return 0;
+}
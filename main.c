@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <locale.h>
 #include <getopt.h>
 #include <gnutls/gnutls.h>
 #include "curses.h"
@@ -18,9 +23,30 @@ static WINDOW *listwin;
 static WINDOW *cmdwin;
 
 struct editor *cmded, *texted;
+static const char *texted_doc;
 
-static struct session *sessions[MAX_SESSIONS];
-static int nsessions, cursession;
+/*
+ * Sessions live in a table of slots that grows as needed; freed slots
+ * are reused lowest first, so session numbers stay small. nslots is
+ * one past the highest slot in use.
+ */
+static struct session **sessions;
+static int nslots, slots_size, nsessions, cursession = -1;
+
+/* session owning each fd in the poll set */
+static struct session **fdmap;
+static int fdmap_size;
+
+static struct pollfd *pfds;
+static int pfds_size;
+
+static int metrics_fd = -1;
+static struct obbytrace *tracer;
+static struct obbyhist display_hist;
+static struct obbywheel wheel;
+
+/* whether the chat or the document is shown */
+static int show_doc;
 
 static const char my_name[] = "nobby";
 static const char my_version[] = "0.1";
@@ -126,6 +152,10 @@ void screen_init(void) {
 	refresh();
 	wrefresh(mainwnd);
 
+	/* have the terminal mark pastes, see input_drain() */
+	fputs("\033[?2004h", stdout);
+	fflush(stdout);
+
 	layout_redo();
 	screen = newwin(layout.chat_h, layout.chat_w, layout.chat_y,
 			layout.chat_x);
@@ -149,13 +179,24 @@ void screen_init(void) {
 
 static void update_display(void)
 {
+	unsigned long long t0 = obby_clock_ns(), t1;
+
 	curs_set(0);
-	wrefresh(screen);
+	if (show_doc) {
+		editor_render(texted);
+		wrefresh(edwin);
+	} else
+		wrefresh(screen);
 	wrefresh(listwin);
 	wrefresh(dbgwin);
 	curs_set(1);
 	wrefresh(cmdwin);
 	refresh();
+
+	t1 = obby_clock_ns();
+	obbyhist_record(&display_hist, t1 - t0);
+	if (tracer)
+		obbytrace_span(tracer, "update_display", "ui", 0, t0, t1);
 }
 
 void screen_resize(void)
@@ -168,6 +209,7 @@ void screen_resize(void)
 	wmove(screen, layout.chat_y, layout.chat_x);
 	wresize(edwin, layout.chat_h, layout.chat_w);
 	wmove(edwin, layout.chat_y, layout.chat_x);
+	editor_view_resize(texted);
 
 	wresize(listwin, layout.lists_h, layout.lists_w);
 	wmove(listwin, layout.lists_y, layout.lists_x);
@@ -180,22 +222,145 @@ void screen_resize(void)
 	__dbgout("geometry: w=%d h=%d\n", layout.w, layout.h);
 }
 
+/* switch the big window between the chat and the document */
+void view_toggle(void)
+{
+	show_doc = !show_doc;
+	touchwin(show_doc ? edwin : screen);
+}
+
+/* write the document out to @path, for :save */
+void doc_save(const char *doc, const char *path)
+{
+	struct rope *text;
+
+	/* the one that's open is the only one we have the text of */
+	if (!texted_doc || strcmp(doc, texted_doc)) {
+		__dbgout("%s isn't open\n", doc);
+		return;
+	}
+
+	text = editor_snapshot(texted);
+	if (save_start(text, path)) {
+		__dbgout("can't save %s: %m\n", path);
+		rope_put(text);
+	}
+}
+
 void screen_end(void) {
+	fputs("\033[?2004l", stdout);
+	fflush(stdout);
 	endwin();
 }
 
+/* what the terminal puts around a paste */
+#define PASTE_START "\033[200~"
+#define PASTE_END "\033[201~"
+
+/* plain characters read, not yet put into the command line */
+static char *input;
+static size_t input_len, input_size;
+static int pasting;
+
+static void input_flush(void)
+{
+	if (pasting)
+		editor_paste(cmded, input, input_len);
+	else
+		editor_putstr(cmded, input, input_len);
+	input_len = 0;
+}
+
+/* does the input end in @marker? if so, it's dropped */
+static int __input_marker(const char *marker)
+{
+	size_t n = strlen(marker);
+
+	if (input_len < n || memcmp(input + input_len - n, marker, n))
+		return 0;
+
+	input_len -= n;
+
+	return 1;
+}
+
+/*
+ * Read all the keys there are, rather than one per wakeup, and leave the
+ * screen for later: runs of plain characters go into the command line
+ * in one go, and so does everything in a paste, which takes as many
+ * wakeups as it takes to end. It's all drawn once, by update_display().
+ */
+static void input_drain(void)
+{
+	size_t n, keep;
+	char *buf;
+	int ch;
+
+	while ((ch = getch()) != ERR) {
+		/* keys of their own; the ones in a paste are just text */
+		if (ch > 0xff || (!pasting && ch != PASTE_START[0] &&
+					(ch < ' ' || ch == 0x7f))) {
+			if (pasting)
+				continue;
+
+			input_flush();
+			editor_gotchar(cmded, ch);
+			continue;
+		}
+
+		if (input_len == input_size) {
+			n = input_size ? input_size * 2 : 256;
+			buf = realloc(input, n);
+			if (!buf)
+				break;
+
+			input = buf;
+			input_size = n;
+		}
+
+		input[input_len++] = ch;
+		if (!pasting && __input_marker(PASTE_START)) {
+			input_flush();
+			pasting = 1;
+		} else if (pasting && __input_marker(PASTE_END)) {
+			input_flush();
+			pasting = 0;
+		}
+	}
+
+	if (pasting)
+		return;
+
+	/* what may be the start of a marker waits for the rest of it */
+	for (keep = sizeof(PASTE_START) - 2; keep; keep--)
+		if (input_len >= keep && !memcmp(input + input_len - keep,
+					PASTE_START, keep))
+			break;
+
+	n = input_len - keep;
+	input_len = n;
+	input_flush();
+	if (keep)
+		memmove(input, input + n, keep);
+	input_len = keep;
+}
+
 /* for cobby to output it's diag() to our debug window */
 void __dbgout(const char *fmt, ...)
 {
-	va_list args;
+	va_list args, copy;
 	FILE *f;
 
 	f = fopen("/tmp/nobby", "a");
 	va_start(args, fmt);
+	/* each of these uses the arguments up */
+	va_copy(copy, args);
 	vwprintw(dbgwin, fmt, args);
-	if (f)
-		vfprintf(f, fmt, args);
-	fclose(f);
+	if (f) {
+		vfprintf(f, fmt, copy);
+		fclose(f);
+	}
+	va_end(copy);
 	va_end(args);
 }
 
@@ -208,35 +373,150 @@ static void __chatout(const char *fmt, ...)
 	va_end(args);
 }
 
-static int __obby_notify_callback(void *priv, struct obbyevent *oe)
+/* print a chat line and remember it in the session's history */
+static void __chatlog(struct session *s, const char *fmt, ...)
+{
+	va_list args;
+	char *msg;
+	int n;
+
+	va_start(args, fmt);
+	n = vasprintf(&msg, fmt, args);
+	va_end(args);
+
+	if (n < 0)
+		return;
+
+	if (s == session_current()) {
+		waddstr(screen, msg);
+		waddch(screen, '\n');
+	}
+	if (s->s_hist)
+		chathist_append(s->s_hist, msg);
+
+	free(msg);
+}
+
+static int __chat_match(void *priv, unsigned long seq, const char *msg,
+		size_t len)
+{
+	int *left = priv;
+
+	wprintw(screen, "%8lu: %.*s\n", seq, (int)len, msg);
+
+	return !--*left;
+}
+
+/* show the most recent matches that fit on the screen */
+void chat_search(struct session *s, const char *pat)
+{
+	int left = getmaxy(screen) - 1;
+	long n;
+
+	if (!s || !s->s_hist)
+		return;
+
+	wprintw(screen, "/// searching for '%s'\n", pat);
+	n = chathist_search(s->s_hist, pat, -1UL, __chat_match, &left);
+	wprintw(screen, "/// %ld match%s shown\n", n, n == 1 ? "" : "es");
+}
+
+/* redisplay a screenful of history, page 1 being the most recent */
+void chat_page(struct session *s, unsigned page)
 {
-	int sn = (int)priv;
-	struct obbysess *os = sessions[sn]->s_obby;
+	unsigned long seq, first, next;
+	int h = getmaxy(screen) - 1;
+	const char *msg;
+	size_t len;
+
+	if (!s || !s->s_hist || !page)
+		return;
+
+	first = chathist_first(s->s_hist);
+	next = chathist_next(s->s_hist);
+	if ((unsigned long)page * h > next - first)
+		seq = first;
+	else
+		seq = next - (unsigned long)page * h;
+
+	werase(screen);
+	for (; h-- && seq < next; seq++) {
+		msg = chathist_get(s->s_hist, seq, &len);
+		wprintw(screen, "%.*s\n", (int)len, msg);
+	}
+}
+
+static void session_event(struct session *s, struct obbyevent *oe)
+{
+	struct obbysess *os = s->s_obby;
+	size_t pos, end;
 
 	switch (oe->oe_type) {
 		case OETYPE_USER_JOINED:
 		case OETYPE_USER_PARTED:
-			__chatout("--- %s has %sed\n", oe->oe_username,
+			__chatlog(s, "--- %s has %sed", oe->oe_username,
 					oe->oe_type == OETYPE_USER_JOINED
 					? "join" : "part");
 		case OETYPE_USER_KNOWN:
 		case OETYPE_DOC_KNOWN:
-			show_lists(os);
+			if (s == session_current())
+				show_lists(os);
 			break;
 
 		case OETYPE_DOC_OPEN:
-			__chatout("+++ opening %s\n", oe->oe_docname);
+			__chatout("+++ opening %s, F2 to view\n",
+					oe->oe_docname);
+			editor_clear(texted);
+			texted_doc = oe->oe_docname;
 			break;
 
 		case OETYPE_DOC_GETCHUNK:
-			__chatout("+++ HERE GOES:\n%s\n", oe->oe_message);
-			editor_addchunk(texted, 0, 0, oe->oe_message, 0);
+			editor_remote_insert(texted, EDITOR_END, oe->oe_message,
+					strlen(oe->oe_message));
+			break;
+
+		case OETYPE_DOC_INSERT:
+			if (oe->oe_docname != texted_doc)
+				break;
+
+			pos = oe->oe_pos;
+			if (oe->oe_flags & OEFLAG_CHARS)
+				pos = editor_charoff(texted, pos);
+
+			if (pos != (size_t)-1)
+				editor_remote_insert(texted, pos, oe->oe_message,
+						oe->oe_length);
+			break;
+
+		case OETYPE_DOC_DELETE:
+			if (oe->oe_docname != texted_doc)
+				break;
+
+			pos = oe->oe_pos;
+			end = oe->oe_pos + oe->oe_length;
+			if (oe->oe_flags & OEFLAG_CHARS) {
+				pos = editor_charoff(texted, pos);
+				end = editor_charoff(texted, end);
+			}
+
+			if (pos != (size_t)-1 && end != (size_t)-1)
+				editor_remote_delete(texted, pos, end - pos);
 			break;
 
 		case OETYPE_CHAT_MESSAGE:
-			__chatout("<%s> %s\n", oe->oe_username,
-					obby_unescape_string(oe->oe_message,
-						-1));
+			__chatlog(s, "<%s> %s", oe->oe_username,
+					oe->oe_message);
+			break;
+
+		case OETYPE_DISCONNECT:
+			__chatlog(s, "!!! connection lost, reconnecting in %ld ms",
+					oe->oe_length);
+			if (s == session_current())
+				show_lists(os);
+			break;
+
+		case OETYPE_RECONNECT:
+			__chatlog(s, "!!! reconnected");
 			break;
 
 		case OETYPE_DEBUG_MESSAGE:
@@ -246,8 +526,50 @@ static int __obby_notify_callback(void *priv, struct obbyevent *oe)
 		default:
 			break;
 	}
+}
 
-	return 0;
+/* handle whatever events the session has queued */
+static void session_events(struct session *s)
+{
+	struct obbyevent oe;
+
+	if (s->s_type == STYPE_OBBY)
+		while (obbysess_next_event(s->s_obby, &oe))
+			session_event(s, &oe);
+}
+
+static void sessions_events(void)
+{
+	int sn;
+
+	for (sn = 0; sn < nslots; sn++)
+		if (sessions[sn])
+			session_events(sessions[sn]);
+}
+
+/* find a free slot, growing the table if there's none */
+static int session_slot(void)
+{
+	struct session **p;
+	int sn, size;
+
+	for (sn = 0; sn < nslots; sn++)
+		if (!sessions[sn])
+			return sn;
+
+	if (nslots == slots_size) {
+		size = slots_size ? slots_size * 2 : 16;
+		p = realloc(sessions, size * sizeof(struct session *));
+		if (!p)
+			return -1;
+
+		sessions = p;
+		slots_size = size;
+	}
+
+	sessions[nslots] = NULL;
+
+	return nslots++;
 }
 
 struct session *session_create(int type, ...)
@@ -255,12 +577,20 @@ struct session *session_create(int type, ...)
 	struct session *s;
 	va_list args;
 	char *host, *service;
-	int conntype;
+	int conntype, sn;
+
+	sn = session_slot();
+	if (sn == -1)
+		return NULL;
 
 	s = malloc(sizeof(struct session));
 	if (!s)
 		return NULL;
 
+	s->s_slot = sn;
+
+	s->s_hist = chathist_create(CHATHIST_DEFAULT);
+
 	va_start(args, type);
 	switch (type) {
 		case STYPE_OBBY:
@@ -270,14 +600,17 @@ struct session *session_create(int type, ...)
 			conntype = va_arg(args, int);
 			s->s_obby = obbysess_create(host, service, conntype);
 			if (s->s_obby) {
-				obbysess_set_notify_callback(s->s_obby,
-						__obby_notify_callback,
-						(void *)nsessions);
+				obbysess_set_timing(s->s_obby, tracer, sn + 1);
+				obbysess_set_timers(s->s_obby, &wheel);
+				/* logs in as soon as the handshake is done */
+				obbysess_join(s->s_obby, G.nick, G.color);
 				break;
 			}
 			/* otherwise fall through */
 
 		default:
+			if (s->s_hist)
+				chathist_destroy(s->s_hist);
 			free(s);
 			return NULL;
 	}
@@ -285,20 +618,23 @@ struct session *session_create(int type, ...)
 
 	s->s_type = type;
 
-	sessions[nsessions++] = s;
-	if (nsessions == 1)
-		cursession = 0;
+	sessions[sn] = s;
+	nsessions++;
+	if (cursession == -1)
+		cursession = sn;
 
 	return s;
 }
 
 void session_destroy(int sn)
 {
-	struct session *s = sessions[sn];
+	struct session *s;
 
-	if (!s)
+	if (sn < 0 || sn >= nslots || !sessions[sn])
 		return;
 
+	s = sessions[sn];
+
 	switch (s->s_type) {
 		case STYPE_OBBY:
 			obbysess_destroy(s->s_obby);
@@ -308,21 +644,228 @@ void session_destroy(int sn)
 			break;
 	}
 
+	if (s->s_hist)
+		chathist_destroy(s->s_hist);
 	free(s);
 	sessions[sn] = NULL;
+	nsessions--;
+
+	while (nslots && !sessions[nslots - 1])
+		nslots--;
+
+	if (sn == cursession) {
+		cursession = -1;
+		session_cycle(1);
+	}
+}
+
+/* make session @sn the one the chat, lists and commands refer to */
+void session_switch(int sn)
+{
+	struct session *s;
+
+	if (sn < 0 || sn >= nslots || !sessions[sn]) {
+		__dbgout("no session %d\n", sn);
+		return;
+	}
+
+	cursession = sn;
+	s = sessions[sn];
+
+	werase(listwin);
+	chat_page(s, 1);
+	if (s->s_type == STYPE_OBBY)
+		show_lists(s->s_obby);
+}
+
+/* switch to the next (@dir > 0) or previous session, wrapping around */
+void session_cycle(int dir)
+{
+	int i, sn;
+
+	for (i = 1; i <= nslots; i++) {
+		sn = ((cursession == -1 ? 0 : cursession) + nslots +
+				(dir > 0 ? i : -i)) % nslots;
+		if (sessions[sn]) {
+			session_switch(sn);
+			return;
+		}
+	}
+}
+
+static const char *state_names[] = {
+	[OSSTATE_NONE]		= "closed",
+	[OSSTATE_OPEN]		= "open",
+	[OSSTATE_SHOOKHANDS]	= "shook hands",
+	[OSSTATE_JOINED]	= "joined",
+	[OSSTATE_SYNCED]	= "synced",
+	[OSSTATE_ERROR]		= "error",
+	[OSSTATE_RECONNECT]	= "reconnecting",
+};
+
+void session_list(void)
+{
+	struct obbysess *os;
+	int sn;
+
+	wprintw(screen, "--- %d session%s\n", nsessions,
+			nsessions == 1 ? "" : "s");
+	for (sn = 0; sn < nslots; sn++) {
+		if (!sessions[sn] || sessions[sn]->s_type != STYPE_OBBY)
+			continue;
+
+		os = sessions[sn]->s_obby;
+		wprintw(screen, "%c%3d  %s:%s  %s, %d users, %d documents\n",
+				sn == cursession ? '*' : ' ', sn,
+				os->os_host, os->os_port,
+				state_names[os->os_state], os->os_eusers,
+				os->os_edocs);
+	}
+}
+
+/* human readable version of the session's counters, for :stats */
+void session_show_stats(struct session *s)
+{
+	struct obbystats *st;
+	int i;
+
+	if (!s || s->s_type != STYPE_OBBY)
+		return;
+
+	st = &s->s_obby->os_stats;
+	__chatout("=== in: %lu bytes, out: %lu bytes, queued: %lu "
+			"(peak %lu, refused %lu)\n", st->st_bytes_in,
+			st->st_bytes_out, obbysess_outq(s->s_obby),
+			st->st_outq_peak, st->st_outq_full);
+	for (i = 0; obby_prio_name(i); i++)
+		__chatout("===   queued %-21s %lu\n", obby_prio_name(i),
+				obbysess_outq_prio(s->s_obby, i));
+	__chatout("=== unknown commands: %lu, parse errors: %lu, "
+			"streamed chunks: %lu, last sync: %llu us\n",
+			st->st_unknown_cmds, st->st_parse_errors,
+			st->st_streamed, st->st_sync_ns / 1000);
+
+	for (i = 0; obby_command_name(i); i++)
+		if (st->st_cmds[i])
+			__chatout("===   %-28s %lu\n", obby_command_name(i),
+					st->st_cmds[i]);
+
+	for (i = 1; i < OETYPE_NR; i++)
+		if (st->st_events[i])
+			__chatout("===   event %-22s %lu\n", obby_event_name(i),
+					st->st_events[i]);
+}
+
+static void __show_hist(const char *name, struct obbyhist *h)
+{
+	if (!h->h_count)
+		return;
+
+	__chatout("~~~ %-26s %8lu %9llu %9llu %9llu\n", name, h->h_count,
+			obbyhist_percentile(h, 50.0) / 1000,
+			obbyhist_percentile(h, 99.0) / 1000,
+			h->h_max / 1000);
+}
+
+/* latency percentiles, for :latency */
+void session_show_latency(struct session *s)
+{
+	struct obbytiming *ot;
+	int i;
+
+	__chatout("~~~ %-26s %8s %9s %9s %9s\n", "(microseconds)", "count",
+			"p50", "p99", "max");
+	__show_hist("update_display", &display_hist);
+
+	if (!s || s->s_type != STYPE_OBBY || !s->s_obby->os_timing)
+		return;
+
+	ot = s->s_obby->os_timing;
+	__show_hist("obbysess_do", &ot->ot_do);
+	for (i = 0; obby_command_name(i); i++)
+		__show_hist(obby_command_name(i), &ot->ot_cmds[i]);
+}
+
+/*
+ * Metrics socket: every client that connects gets the counters of all
+ * sessions in Prometheus text format, after which the connection is
+ * closed
+ */
+static int metrics_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+			listen(fd, 8) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+static void metrics_do(void)
+{
+	struct obbysess **os;
+	FILE *f;
+	int fd, i;
+
+	if (metrics_fd == -1)
+		return;
+
+	while ((fd = accept(metrics_fd, NULL, NULL)) != -1) {
+		os = malloc((nslots ? nslots : 1) * sizeof(struct obbysess *));
+		if (!os) {
+			close(fd);
+			continue;
+		}
+
+		/* the scraper is local, don't let it block us for long */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+		f = fdopen(fd, "w");
+		if (!f) {
+			close(fd);
+			free(os);
+			continue;
+		}
+
+		for (i = 0; i < nslots; i++)
+			os[i] = sessions[i] && sessions[i]->s_type == STYPE_OBBY
+				? sessions[i]->s_obby : NULL;
+
+		obbysess_stats_export(f, os, nslots);
+		fclose(f);
+		free(os);
+	}
 }
 
 struct session *session_current(void)
 {
-	return sessions[cursession];
+	return cursession == -1 ? NULL : sessions[cursession];
 }
 
-int session_get_fd(int sn)
+int session_get_fd(struct session *s)
 {
-	switch (sessions[sn]->s_type)
+	switch (s->s_type)
 	{
 		case STYPE_OBBY:
-			return sessions[sn]->s_obby->os_sock;
+			return s->s_obby->os_sock;
 
 		default:
 			break;
@@ -336,11 +879,12 @@ int session_do(struct session *s)
 	switch (s->s_type) {
 		case STYPE_OBBY:
 			obbysess_do(s->s_obby);
-			if (s->s_obby->os_state == OSSTATE_SHOOKHANDS) {
-				obbysess_join(s->s_obby, G.nick, G.color);
-				G.state = NSTATE_CONNECTED;
-			} else if (s->s_obby->os_state == OSSTATE_ERROR)
+			session_events(s);
+			if (s->s_obby->os_state == OSSTATE_ERROR)
 				return -1;
+			else if (s->s_obby->os_state >= OSSTATE_SHOOKHANDS &&
+					s->s_obby->os_state != OSSTATE_RECONNECT)
+				G.state = NSTATE_CONNECTED;
 
 			break;
 
@@ -351,22 +895,107 @@ int session_do(struct session *s)
 	return 0;
 }
 
-void sessions_do(void)
+/* make room for @n entries in the poll set */
+static int pollset_reserve(int n)
 {
-	int n;
+	struct pollfd *p;
+
+	if (n <= pfds_size)
+		return 0;
+
+	p = realloc(pfds, n * sizeof(struct pollfd));
+	if (!p)
+		return -1;
+
+	pfds = p;
+	pfds_size = n;
+
+	return 0;
+}
+
+static int fdmap_set(int fd, struct session *s)
+{
+	struct session **p;
+	int size;
+
+	if (fd >= fdmap_size) {
+		for (size = fdmap_size ? fdmap_size : 64; size <= fd; size *= 2)
+			;
+
+		p = realloc(fdmap, size * sizeof(struct session *));
+		if (!p)
+			return -1;
+
+		memset(p + fdmap_size, 0,
+				(size - fdmap_size) * sizeof(struct session *));
+		fdmap = p;
+		fdmap_size = size;
+	}
+
+	fdmap[fd] = s;
+
+	return 0;
+}
+
+/*
+ * Put the sockets of all the connected sessions in the poll set, with
+ * POLLOUT for those that have something to send; sessions that have
+ * buffered input to process zero @timeout. Returns the number of
+ * entries used, leaving room for two more.
+ */
+static int sessions_pollset(int *timeout)
+{
+	int sn, fd, n = 0;
+
+	/* and the metrics socket, saves and the terminal */
+	if (pollset_reserve(nsessions + 3))
+		return -1;
 
-	for (n = 0; n < nsessions; n++) {
-		if (!sessions[n])
+	for (sn = 0; sn < nslots; sn++) {
+		if (!sessions[sn])
 			continue;
 
-		if (session_do(sessions[n]))
-			session_destroy(n);
+		fd = session_get_fd(sessions[sn]);
+		if (fd == -1 || fdmap_set(fd, sessions[sn]))
+			continue;
+
+		pfds[n].fd = fd;
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		if (sessions[sn]->s_type == STYPE_OBBY) {
+			if (obbysess_outq(sessions[sn]->s_obby))
+				pfds[n].events |= POLLOUT;
+			if (obbysess_pending(sessions[sn]->s_obby))
+				*timeout = 0;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/* run the sessions that poll() found ready among the first @n entries */
+static void sessions_dispatch(int n)
+{
+	struct session *s;
+	int i, ready;
+
+	for (i = 0; i < n; i++) {
+		s = fdmap[pfds[i].fd];
+
+		ready = pfds[i].revents ||
+			(s->s_type == STYPE_OBBY &&
+			 obbysess_pending(s->s_obby));
+		if (ready && session_do(s))
+			session_destroy(s->s_slot);
 	}
 }
 
 static const struct option options[] = {
 	{ "nick",               1, 0, 'n' },
 	{ "color",              1, 0, 'c' },
+	{ "metrics",            1, 0, 'm' },
+	{ "trace",              1, 0, 't' },
 	{ "help",               0, 0, 'h' },
 	{ NULL,                 0, 0, 0   },
 };
@@ -374,10 +1003,12 @@ static const struct option options[] = {
 static const char *options_desc[] = {
 	"specify your desired nickname",
 	"specify your desired color",
+	"export metrics on this unix socket",
+	"write a chrome trace of timed spans to this file",
 	"print help message and exit",
 };
 
-static const char *optstr = "n:c:h";
+static const char *optstr = "n:c:m:t:h";
 
 static void usage(const char *msg, int exit_code)
 {
@@ -399,8 +1030,10 @@ static void usage(const char *msg, int exit_code)
 
 int main(int argc, char **argv)
 {
-	int ch, loptidx, c, n = 0;
-	struct pollfd fds[MAX_SESSIONS];
+	int loptidx, c, n, nfds, timeout;
+
+	/* document text is UTF-8, and so should the terminal be */
+	setlocale(LC_ALL, "");
 
 	for (;;) {
 		c = getopt_long(argc, argv, optstr, options, &loptidx);
@@ -416,6 +1049,20 @@ int main(int argc, char **argv)
 				G.color = strdup(optarg);
 				break;
 
+			case 'm':
+				metrics_fd = metrics_listen(optarg);
+				if (metrics_fd == -1)
+					usage("can't listen on metrics socket",
+							EXIT_FAILURE);
+				break;
+
+			case 't':
+				tracer = obbytrace_open(optarg);
+				if (!tracer)
+					usage("can't open trace file",
+							EXIT_FAILURE);
+				break;
+
 			case 'h':
 				usage(NULL, EXIT_SUCCESS);
 
@@ -443,54 +1090,74 @@ int main(int argc, char **argv)
 	if (!G.color)
 		G.color = strdup("ffffff");
 
-	memset(&fds, 0, sizeof(fds));
+	if (obby_init())
+		usage("can't initialize TLS", EXIT_FAILURE);
+
+	obbywheel_init(&wheel, obby_clock_ms());
 
 	screen_init();
 
 	cmded = editor_create(cmdwin, NULL);
-	if (!cmded)
+	if (!cmded || editor_undo_enable(cmded, EDUNDO_DEFAULT))
 		exit(EXIT_FAILURE);
 
 	texted = editor_create(edwin, NULL);
-	if (!texted)
+	if (!texted || editor_view_resize(texted))
 		exit(EXIT_FAILURE);
 
 	editor_addline(cmded, 0, 0, NULL, 0);
 
 	while (G.state < NSTATE_LEAVING) {
-		sessions_do();
-
+		obbywheel_run(&wheel, obby_clock_ms());
+		sessions_events();
 		update_display();
 
-		ch = getch();
-		editor_gotchar(cmded, ch);
+		timeout = obbywheel_timeout(&wheel, 100, obby_clock_ms());
+		nfds = n = sessions_pollset(&timeout);
+		if (n == -1) {
+			__dbgout("out of memory for the poll set\n");
+			break;
+		}
 
-		if (!n) {
-			int s;
+		if (metrics_fd != -1) {
+			pfds[n].fd = metrics_fd;
+			pfds[n++].events = POLLIN;
+		}
 
-			for (c = 0, s = 0; c < nsessions; c++) {
-				if (!sessions[c])
-					continue;
+		if (save_fd() != -1) {
+			pfds[n].fd = save_fd();
+			pfds[n++].events = POLLIN;
+		}
 
-				fds[s].fd = session_get_fd(c);
-				fds[s++].events = POLLIN;
-			}
+		pfds[n].fd = 0;
+		pfds[n++].events = POLLIN;
 
-			fds[s].fd = 0;
-			fds[s].events = POLLIN;
-			n = poll(fds, c + 1, 100);
-			if (n == -1) {
-				if (errno != EINTR)
-					__dbgout("poll failed: %m");
-				n = 0;
-			}
-		} else
-			n--;
+		if (poll(pfds, n, timeout) == -1) {
+			if (errno != EINTR)
+				__dbgout("poll failed: %m");
+			continue;
+		}
+
+		sessions_dispatch(nfds);
+		metrics_do();
+		save_reap();
+
+		input_drain();
 	}
 	screen_end();
+	save_wait();
 
-	for (c = 0; c < nsessions; c++)
+	for (c = 0; c < nslots; c++)
 		session_destroy(c);
 
+	free(sessions);
+	free(fdmap);
+	free(pfds);
+
+	if (tracer)
+		obbytrace_close(tracer);
+
+	obby_fini();
+
 	return 0;
 }
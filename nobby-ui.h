@@ -3,9 +3,61 @@
 
 void screen_resize(void);
 
+/* the editor's text, see rope.c */
+struct rope;
+
+struct rope *rope_new(const char *buf, size_t len);
+struct rope *rope_get(struct rope *r);
+void rope_put(struct rope *r);
+size_t rope_len(struct rope *r);
+size_t rope_newlines(struct rope *r);
+size_t rope_chars(struct rope *r);
+struct rope *rope_insert(struct rope *r, size_t off, const char *buf,
+		size_t len, int *err);
+struct rope *rope_delete(struct rope *r, size_t off, size_t len, int *err);
+size_t rope_line_start(struct rope *r, size_t line);
+size_t rope_line_of(struct rope *r, size_t off);
+size_t rope_char_offset(struct rope *r, size_t n);
+size_t rope_copy(struct rope *r, size_t off, size_t len, char *dst);
+
+typedef int (*rope_fn_t)(void *, const char *, size_t);
+
+int rope_foreach(struct rope *r, rope_fn_t fn, void *priv);
+
+/* undo log, see undo.c */
+#define EDUNDO_DEFAULT (1024 * 1024)
+
+struct edundo;
+
+struct edundo *edundo_create(size_t max);
+void edundo_destroy(struct edundo *u);
+void edundo_clear(struct edundo *u);
+void edundo_break(struct edundo *u);
+int edundo_insert(struct edundo *u, size_t off, const char *buf, size_t len,
+		int local);
+int edundo_delete(struct edundo *u, struct rope *r, size_t off, size_t len,
+		int local);
+int edundo_step(struct edundo *u, int redo, size_t *off, size_t *len,
+		const char **text, int *ins);
+
+/* display layout of a line, see width.c */
+struct edwidth {
+	unsigned w_line;
+	int w_valid;
+	unsigned w_width;	/* in columns */
+	unsigned w_n;		/* clusters */
+	unsigned w_size;
+	unsigned *w_off;	/* byte offset of each cluster and the end */
+	unsigned *w_col;	/* column of each cluster and the end */
+};
+
+#define EDWIDTH_CACHE 256
+#define EDITOR_TABSTOP 8
+
 struct editor {
 	WINDOW *e_win;
-	char **e_buf;
+	/* the lines of the buffer joined with newlines */
+	struct rope *e_text;
 	/* be careful with the concept of lines:
 	 *  - e_lines == amount of lines in the buffer (0 means empty)
 	 *  - e_curline == number of current line (0 means first line)
@@ -14,23 +66,93 @@ struct editor {
 	unsigned e_curline;
 	unsigned e_curpos;
 	void *e_priv;
+	struct edsearch *e_search;
+	/* editor_getline() returns lines in here */
+	char *e_line;
+	size_t e_linesz;
+	/* viewport: first line shown, rows, rows needing a redraw */
+	unsigned e_top;
+	unsigned e_rows;
+	unsigned char *e_dirty;
+	struct edwidth *e_width;
+	struct edundo *e_undo;
 };
 
+#define EDITOR_END ((size_t)-1)
+
 struct editor *editor_create(WINDOW *win, void *priv);
 void editor_destroy(struct editor *e);
+void editor_clear(struct editor *e);
+const char *editor_getline(struct editor *e, unsigned line, size_t *len);
+struct rope *editor_snapshot(struct editor *e);
+int editor_locate(struct editor *e, size_t off, unsigned *line,
+		unsigned *col);
+size_t editor_charoff(struct editor *e, size_t n);
+int editor_insert(struct editor *e, size_t off, const char *buf, size_t len);
+int editor_delete(struct editor *e, size_t off, size_t len);
+int editor_remote_insert(struct editor *e, size_t off, const char *buf,
+		size_t len);
+int editor_remote_delete(struct editor *e, size_t off, size_t len);
+int editor_undo_enable(struct editor *e, size_t max);
+int editor_undo(struct editor *e, int redo);
 int editor_addline(struct editor *e, int line, int pos, char *buf, unsigned f);
 int editor_killline(struct editor *e, int line, int pos, ssize_t len);
 int editor_gotchar(struct editor *e, int ch);
+void editor_putstr(struct editor *e, const char *buf, size_t len);
+void editor_paste(struct editor *e, char *buf, size_t len);
 int editor_addchunk(struct editor *e, int line, int pos, char *buf,
 		unsigned f);
-
-#define MAX_SESSIONS 16
+void editor_clearline(struct editor *e);
+
+const struct edwidth *editor_width(struct editor *e, unsigned line);
+void editor_width_changed(struct editor *e, unsigned line, unsigned old,
+		unsigned new);
+void editor_width_free(struct editor *e);
+unsigned editor_column(struct editor *e, unsigned line, unsigned pos);
+unsigned editor_stepchar(struct editor *e, unsigned line, unsigned pos,
+		int dir);
+
+/* viewport rendering, see view.c */
+int editor_view_resize(struct editor *e);
+void editor_view_changed(struct editor *e, unsigned line, unsigned old,
+		unsigned new);
+void editor_view_show(struct editor *e, unsigned line);
+void editor_scroll(struct editor *e, int delta);
+void editor_render(struct editor *e);
+
+/* in-document search, see search.c */
+struct edsearch;
+
+int search_create(struct editor *e, const char *pat, int regex);
+void search_destroy(struct editor *e);
+void search_update(struct editor *e, unsigned line, unsigned old,
+		unsigned new);
+int search_jump(struct editor *e, int dir);
+unsigned search_count(struct editor *e);
+
+/* chat history, see history.c */
+#define CHATHIST_DEFAULT (512 * 1024)
+
+struct chathist;
+typedef int (*chathist_match_fn_t)(void *, unsigned long, const char *,
+		size_t);
+
+struct chathist *chathist_create(unsigned long maxmsgs);
+void chathist_destroy(struct chathist *ch);
+long chathist_append(struct chathist *ch, const char *msg);
+unsigned long chathist_first(struct chathist *ch);
+unsigned long chathist_next(struct chathist *ch);
+const char *chathist_get(struct chathist *ch, unsigned long seq, size_t *len);
+long chathist_search(struct chathist *ch, const char *pat,
+		unsigned long before, chathist_match_fn_t fn, void *priv);
 
 struct session {
 	int s_type;
+	int s_slot;
 	union {
 		struct obbysess *s_obby;
 	};
+	struct chathist *s_hist;
 };
 
 enum {
@@ -41,6 +163,19 @@ enum {
 struct session *session_create(int type, ...);
 void session_destroy(int sn);
 struct session *session_current(void);
+void session_switch(int sn);
+void session_cycle(int dir);
+void session_list(void);
+void view_toggle(void);
+void session_show_stats(struct session *s);
+void session_show_latency(struct session *s);
+
+/* writing documents out, see save.c */
+int save_start(struct rope *text, const char *path);
+int save_fd(void);
+void save_reap(void);
+void save_wait(void);
+void doc_save(const char *doc, const char *path);
 
 extern int nobby_state;
 void cmd_execute(char *cmdbuf, void *os);
@@ -66,6 +201,8 @@ struct global_conf {
 extern struct global_conf G;
 
 void __dbgout(const char *fmt, ...);
+void chat_search(struct session *s, const char *pat);
+void chat_page(struct session *s, unsigned page);
 
 #endif /* __NOBBY_UI_H__ */
 
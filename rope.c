@@ -0,0 +1,525 @@
+#include <stdlib.h>
+#include <string.h>
+#include <curses.h>
+#include "nobby-ui.h"
+
+/*
+ * Rope: the text as an AVL-balanced binary tree whose leaves hold up to
+ * ROPE_LEAF bytes each, every node knowing how many bytes, newlines and
+ * UTF-8 characters are below it. That's all it takes to find a byte
+ * offset, a line, the line a byte offset is in, or where a character
+ * starts in O(log n), and to insert or delete
+ * anywhere in O(log n) by splitting and joining trees.
+ *
+ * Nodes are never modified once built; an edit makes new nodes along
+ * the path it touches and shares everything else with the old tree,
+ * which stays valid as long as someone holds a reference to it. A
+ * snapshot of the text is therefore just rope_get() on its root.
+ *
+ * The internal helpers below all consume the references they are given
+ * and return new ones.
+ */
+#define ROPE_LEAF 1024
+
+struct rope {
+	unsigned r_ref;
+	unsigned r_height;		/* 0 for leaves */
+	size_t r_len;			/* bytes below */
+	size_t r_nl;			/* newlines below */
+	size_t r_chars;			/* characters below */
+	struct rope *r_left;		/* NULL for leaves */
+	struct rope *r_right;
+	char r_data[];			/* leaves only */
+};
+
+#define __height(__r) ((__r) ? (int)(__r)->r_height : -1)
+
+struct rope *rope_get(struct rope *r)
+{
+	if (r)
+		r->r_ref++;
+
+	return r;
+}
+
+void rope_put(struct rope *r)
+{
+	struct rope *right;
+
+	/* iterate down the right spine instead of recursing on it */
+	while (r && !--r->r_ref) {
+		right = r->r_right;
+		rope_put(r->r_left);
+		free(r);
+		r = right;
+	}
+}
+
+size_t rope_len(struct rope *r)
+{
+	return r ? r->r_len : 0;
+}
+
+size_t rope_newlines(struct rope *r)
+{
+	return r ? r->r_nl : 0;
+}
+
+size_t rope_chars(struct rope *r)
+{
+	return r ? r->r_chars : 0;
+}
+
+/* bytes that start a character: anything but a continuation byte */
+static size_t __chars(const char *buf, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++)
+		n += ((unsigned char)buf[i] & 0xc0) != 0x80;
+
+	return n;
+}
+
+static struct rope *__leaf(const char *buf, size_t len)
+{
+	struct rope *r;
+	const char *p;
+
+	r = malloc(sizeof(struct rope) + len);
+	if (!r)
+		return NULL;
+
+	r->r_ref = 1;
+	r->r_height = 0;
+	r->r_len = len;
+	r->r_nl = 0;
+	r->r_chars = __chars(buf, len);
+	r->r_left = r->r_right = NULL;
+	memcpy(r->r_data, buf, len);
+
+	for (p = buf; (p = memchr(p, '\n', buf + len - p)); p++)
+		r->r_nl++;
+
+	return r;
+}
+
+static struct rope *__node(struct rope *l, struct rope *r)
+{
+	struct rope *n;
+
+	if (!l || !r) {
+		rope_put(l);
+		rope_put(r);
+		return NULL;
+	}
+
+	n = malloc(sizeof(struct rope));
+	if (!n) {
+		rope_put(l);
+		rope_put(r);
+		return NULL;
+	}
+
+	n->r_ref = 1;
+	n->r_height = (l->r_height > r->r_height ? l->r_height
+			: r->r_height) + 1;
+	n->r_len = l->r_len + r->r_len;
+	n->r_nl = l->r_nl + r->r_nl;
+	n->r_chars = l->r_chars + r->r_chars;
+	n->r_left = l;
+	n->r_right = r;
+
+	return n;
+}
+
+/* take a node apart, giving up our reference to it */
+static void __unwrap(struct rope *n, struct rope **l, struct rope **r)
+{
+	if (n->r_ref == 1) {
+		*l = n->r_left;
+		*r = n->r_right;
+		free(n);
+	} else {
+		*l = rope_get(n->r_left);
+		*r = rope_get(n->r_right);
+		n->r_ref--;
+	}
+}
+
+/* node(@l, @r) for subtrees whose heights differ by at most two */
+static struct rope *__balance(struct rope *l, struct rope *r)
+{
+	struct rope *a, *b, *c, *d;
+
+	if (!l || !r) {
+		rope_put(l);
+		rope_put(r);
+		return NULL;
+	}
+
+	if (__height(l) > __height(r) + 1) {
+		__unwrap(l, &a, &b);
+		if (__height(a) >= __height(b))
+			return __node(a, __node(b, r));
+
+		__unwrap(b, &c, &d);
+		return __node(__node(a, c), __node(d, r));
+	}
+
+	if (__height(r) > __height(l) + 1) {
+		__unwrap(r, &a, &b);
+		if (__height(b) >= __height(a))
+			return __node(__node(l, a), b);
+
+		__unwrap(a, &c, &d);
+		return __node(__node(l, c), __node(d, b));
+	}
+
+	return __node(l, r);
+}
+
+/* concatenate two ropes, either of which may be empty */
+static struct rope *__join(struct rope *a, struct rope *b)
+{
+	struct rope *l, *r, *m;
+
+	if (!a || !a->r_len) {
+		rope_put(a);
+		return b;
+	}
+
+	if (!b || !b->r_len) {
+		rope_put(b);
+		return a;
+	}
+
+	/* keep small edits from leaving a trail of tiny leaves */
+	if (!a->r_height && !b->r_height &&
+			a->r_len + b->r_len <= ROPE_LEAF) {
+		m = malloc(sizeof(struct rope) + a->r_len + b->r_len);
+		if (m) {
+			m->r_ref = 1;
+			m->r_height = 0;
+			m->r_len = a->r_len + b->r_len;
+			m->r_nl = a->r_nl + b->r_nl;
+			m->r_chars = a->r_chars + b->r_chars;
+			m->r_left = m->r_right = NULL;
+			memcpy(m->r_data, a->r_data, a->r_len);
+			memcpy(m->r_data + a->r_len, b->r_data, b->r_len);
+		}
+
+		rope_put(a);
+		rope_put(b);
+		return m;
+	}
+
+	if (__height(a) > __height(b) + 1) {
+		__unwrap(a, &l, &r);
+		return __balance(l, __join(r, b));
+	}
+
+	if (__height(b) > __height(a) + 1) {
+		__unwrap(b, &l, &r);
+		return __balance(__join(a, l), r);
+	}
+
+	return __node(a, b);
+}
+
+/*
+ * Split @r at byte @off into [0, off) and [off, len); returns -1 if out
+ * of memory, in which case both halves are NULL
+ */
+static int __split(struct rope *r, size_t off, struct rope **left,
+		struct rope **right)
+{
+	struct rope *l, *rr, *t;
+
+	*left = *right = NULL;
+
+	if (!r)
+		return 0;
+
+	if (!off) {
+		*right = r;
+		return 0;
+	}
+
+	if (off >= r->r_len) {
+		*left = r;
+		return 0;
+	}
+
+	if (!r->r_height) {
+		*left = __leaf(r->r_data, off);
+		*right = __leaf(r->r_data + off, r->r_len - off);
+		rope_put(r);
+		goto check;
+	}
+
+	__unwrap(r, &l, &rr);
+	if (off < l->r_len) {
+		if (__split(l, off, left, &t)) {
+			rope_put(rr);
+			return -1;
+		}
+
+		*right = __join(t, rr);
+	} else {
+		if (__split(rr, off - l->r_len, &t, right)) {
+			rope_put(l);
+			return -1;
+		}
+
+		*left = __join(l, t);
+	}
+
+check:
+	if (!*left || !*right) {
+		rope_put(*left);
+		rope_put(*right);
+		*left = *right = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a balanced rope of @buf, built bottom up from full leaves */
+static struct rope *__build(const char *buf, size_t len)
+{
+	size_t half;
+
+	if (len <= ROPE_LEAF)
+		return __leaf(buf, len);
+
+	/* split on a leaf boundary so that all but the last leaf are full */
+	half = (len / ROPE_LEAF + 1) / 2 * ROPE_LEAF;
+
+	return __node(__build(buf, half), __build(buf + half, len - half));
+}
+
+struct rope *rope_new(const char *buf, size_t len)
+{
+	return len ? __build(buf, len) : NULL;
+}
+
+/*
+ * Return @r with @len bytes of @buf inserted at @off; @r itself is left
+ * alone. *@err is set if we ran out of memory, NULL being a valid
+ * (empty) rope
+ */
+struct rope *rope_insert(struct rope *r, size_t off, const char *buf,
+		size_t len, int *err)
+{
+	struct rope *l, *rr, *m;
+
+	*err = 0;
+	if (!len)
+		return rope_get(r);
+
+	if (off > rope_len(r))
+		goto out_err;
+
+	m = __build(buf, len);
+	if (!m)
+		goto out_err;
+
+	if (__split(rope_get(r), off, &l, &rr)) {
+		rope_put(m);
+		goto out_err;
+	}
+
+	r = __join(__join(l, m), rr);
+	if (!r)
+		goto out_err;
+
+	return r;
+
+out_err:
+	*err = 1;
+	return NULL;
+}
+
+/* return @r with @len bytes at @off removed; see rope_insert() */
+struct rope *rope_delete(struct rope *r, size_t off, size_t len, int *err)
+{
+	size_t total = rope_len(r);
+	struct rope *l, *m, *rr;
+
+	*err = 0;
+	if (!len)
+		return rope_get(r);
+
+	if (off + len > total)
+		goto out_err;
+
+	if (__split(rope_get(r), off, &l, &m))
+		goto out_err;
+
+	if (__split(m, len, &m, &rr)) {
+		rope_put(l);
+		goto out_err;
+	}
+
+	rope_put(m);
+	/* deleting everything leaves the empty rope */
+	r = __join(l, rr);
+	if (!r && len != total)
+		goto out_err;
+
+	return r;
+
+out_err:
+	*err = 1;
+	return NULL;
+}
+
+/*
+ * Byte offset at which line @line starts, i.e. just past the @line-th
+ * newline; -1 if there aren't that many lines
+ */
+size_t rope_line_start(struct rope *r, size_t line)
+{
+	size_t off = 0;
+	const char *p;
+
+	if (!line)
+		return 0;
+
+	if (line > rope_newlines(r))
+		return -1;
+
+	while (r->r_height) {
+		if (line <= r->r_left->r_nl)
+			r = r->r_left;
+		else {
+			line -= r->r_left->r_nl;
+			off += r->r_left->r_len;
+			r = r->r_right;
+		}
+	}
+
+	for (p = r->r_data; ; p++) {
+		p = memchr(p, '\n', r->r_data + r->r_len - p);
+		if (!--line)
+			break;
+	}
+
+	return off + (p - r->r_data) + 1;
+}
+
+/* number of the line byte @off is in */
+size_t rope_line_of(struct rope *r, size_t off)
+{
+	size_t line = 0;
+	const char *p, *end;
+
+	if (off > rope_len(r))
+		off = rope_len(r);
+
+	while (r && r->r_height) {
+		if (off < r->r_left->r_len)
+			r = r->r_left;
+		else {
+			off -= r->r_left->r_len;
+			line += r->r_left->r_nl;
+			r = r->r_right;
+		}
+	}
+
+	if (!r)
+		return 0;
+
+	for (p = r->r_data, end = p + off; (p = memchr(p, '\n', end - p));
+			p++)
+		line++;
+
+	return line;
+}
+
+/*
+ * Byte offset at which character @n starts, the length of the rope if
+ * @n is the number of characters in it; -1 if it's past that
+ */
+size_t rope_char_offset(struct rope *r, size_t n)
+{
+	size_t off = 0;
+	const char *p;
+
+	if (n >= rope_chars(r))
+		return n == rope_chars(r) ? rope_len(r) : -1;
+
+	while (r->r_height) {
+		if (n < r->r_left->r_chars)
+			r = r->r_left;
+		else {
+			n -= r->r_left->r_chars;
+			off += r->r_left->r_len;
+			r = r->r_right;
+		}
+	}
+
+	for (p = r->r_data; ; p++)
+		if (((unsigned char)*p & 0xc0) != 0x80 && !n--)
+			break;
+
+	return off + (p - r->r_data);
+}
+
+/*
+ * Copy out up to @len bytes starting at @off, returns the number of
+ * bytes copied
+ */
+size_t rope_copy(struct rope *r, size_t off, size_t len, char *dst)
+{
+	size_t n, done = 0;
+
+	if (!r || off >= r->r_len)
+		return 0;
+
+	if (len > r->r_len - off)
+		len = r->r_len - off;
+
+	while (done < len) {
+		struct rope *t = r;
+		size_t o = off + done;
+
+		while (t->r_height) {
+			if (o < t->r_left->r_len)
+				t = t->r_left;
+			else {
+				o -= t->r_left->r_len;
+				t = t->r_right;
+			}
+		}
+
+		n = t->r_len - o;
+		if (n > len - done)
+			n = len - done;
+
+		memcpy(dst + done, t->r_data + o, n);
+		done += n;
+	}
+
+	return done;
+}
+
+/*
+ * Hand the text to @fn leaf by leaf, in order and without copying it;
+ * stops at the first non-zero @fn returns, and returns that
+ */
+int rope_foreach(struct rope *r, rope_fn_t fn, void *priv)
+{
+	int ret;
+
+	/* recursing on the left only, as rope_put() does */
+	for (; r && r->r_height; r = r->r_right) {
+		ret = rope_foreach(r->r_left, fn, priv);
+		if (ret)
+			return ret;
+	}
+
+	return r && r->r_len ? fn(priv, r->r_data, r->r_len) : 0;
+}
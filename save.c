@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <gnutls/gnutls.h>
+#include "curses.h"
+#include "cobby.h"
+#include "nobby-ui.h"
+
+/*
+ * Writing a document out, for :save. The UI thread takes a snapshot of
+ * the rope, and a thread of its own writes that out leaf by leaf with
+ * writev(), without ever copying it into one buffer, to a temporary
+ * file next to the destination that is renamed over it once complete:
+ * whoever reads the file gets the old version or the new one, never
+ * half of each. Ropes are immutable, so the snapshot can be read while
+ * the editor moves on, but reference counts aren't atomic: the
+ * snapshot is let go of back on the UI thread, which finished saves
+ * are handed back to through a pipe that the main loop polls.
+ */
+#define SAVE_IOV 256
+
+struct savejob {
+	struct rope *sj_text;
+	char *sj_path;
+	char *sj_tmp;
+	int sj_fd;
+	int sj_err;		/* errno, 0 if it all went well */
+	size_t sj_len;
+	unsigned long long sj_ns;
+	struct iovec sj_iov[SAVE_IOV];
+	int sj_niov;
+};
+
+static int save_pipe[2] = { -1, -1 };
+static unsigned save_running;
+
+/* write out what's gathered in sj_iov, however many goes it takes */
+static int __flush(struct savejob *sj)
+{
+	struct iovec *iov = sj->sj_iov;
+	int n = sj->sj_niov;
+	ssize_t done;
+
+	while (n) {
+		done = writev(sj->sj_fd, iov, n);
+		if (done == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		sj->sj_len += done;
+		for (; n && done >= iov->iov_len; iov++, n--)
+			done -= iov->iov_len;
+
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	sj->sj_niov = 0;
+
+	return 0;
+}
+
+static int __piece(void *priv, const char *buf, size_t len)
+{
+	struct savejob *sj = priv;
+
+	if (sj->sj_niov == SAVE_IOV && __flush(sj))
+		return -1;
+
+	sj->sj_iov[sj->sj_niov].iov_base = (void *)buf;
+	sj->sj_iov[sj->sj_niov++].iov_len = len;
+
+	return 0;
+}
+
+static void *__save(void *priv)
+{
+	struct savejob *sj = priv;
+	unsigned long long t0 = obby_clock_ns();
+	mode_t mode = 0644;
+	struct stat st;
+
+	/* a file that is there already keeps its permissions */
+	if (!stat(sj->sj_path, &st))
+		mode = st.st_mode & 07777;
+
+	sj->sj_fd = mkstemp(sj->sj_tmp);
+	if (sj->sj_fd == -1) {
+		sj->sj_err = errno;
+		goto out;
+	}
+
+	if (fchmod(sj->sj_fd, mode) ||
+			rope_foreach(sj->sj_text, __piece, sj) ||
+			__flush(sj) || fsync(sj->sj_fd))
+		sj->sj_err = errno;
+
+	if (close(sj->sj_fd) && !sj->sj_err)
+		sj->sj_err = errno;
+
+	if (!sj->sj_err && rename(sj->sj_tmp, sj->sj_path))
+		sj->sj_err = errno;
+
+	if (sj->sj_err)
+		unlink(sj->sj_tmp);
+
+out:
+	sj->sj_ns = obby_clock_ns() - t0;
+
+	/* a pointer is well below PIPE_BUF, this won't be torn */
+	while (write(save_pipe[1], &sj, sizeof(sj)) == -1 && errno == EINTR)
+		;
+
+	return NULL;
+}
+
+static void __job_free(struct savejob *sj)
+{
+	rope_put(sj->sj_text);
+	free(sj->sj_path);
+	free(sj->sj_tmp);
+	free(sj);
+}
+
+/*
+ * Write @text out to @path in the background, taking over the reference
+ * to it; -1 if that can't even be started
+ */
+int save_start(struct rope *text, const char *path)
+{
+	struct savejob *sj;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (save_pipe[0] == -1) {
+		if (pipe2(save_pipe, O_CLOEXEC))
+			return -1;
+		fcntl(save_pipe[0], F_SETFL, O_NONBLOCK);
+	}
+
+	sj = calloc(1, sizeof(struct savejob));
+	if (!sj)
+		return -1;
+
+	sj->sj_path = strdup(path);
+	if (!sj->sj_path || asprintf(&sj->sj_tmp, "%s.XXXXXX", path) < 0) {
+		free(sj->sj_path);
+		free(sj);
+		return -1;
+	}
+
+	sj->sj_text = text;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, __save, sj);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		free(sj->sj_path);
+		free(sj->sj_tmp);
+		free(sj);
+		errno = err;
+		return -1;
+	}
+
+	save_running++;
+
+	return 0;
+}
+
+/* what to poll for saves that are done, -1 if none are running */
+int save_fd(void)
+{
+	return save_running ? save_pipe[0] : -1;
+}
+
+static void __reap(struct savejob *sj)
+{
+	save_running--;
+	if (sj->sj_err)
+		__dbgout("can't save %s: %s\n", sj->sj_path,
+				strerror(sj->sj_err));
+	else
+		__dbgout("saved %s, %zu bytes in %llu ms\n", sj->sj_path,
+				sj->sj_len, sj->sj_ns / 1000000);
+
+	__job_free(sj);
+}
+
+/* report on the saves that are done */
+void save_reap(void)
+{
+	struct savejob *sj;
+
+	while (save_running && read(save_pipe[0], &sj, sizeof(sj)) ==
+			sizeof(sj))
+		__reap(sj);
+}
+
+/* wait for all saves to finish, on the way out */
+void save_wait(void)
+{
+	struct savejob *sj;
+
+	if (!save_running)
+		return;
+
+	fcntl(save_pipe[0], F_SETFL, 0);
+	while (save_running) {
+		if (read(save_pipe[0], &sj, sizeof(sj)) != sizeof(sj)) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		__reap(sj);
+	}
+}
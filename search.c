@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <regex.h>
+#include "curses.h"
+#include "nobby-ui.h"
+
+/*
+ * In-document search: all matches of the pattern are found once and
+ * kept sorted by position; when the editor replaces a range of lines,
+ * only those lines are scanned again and the matches that follow are
+ * shifted, so the index stays current while the document is edited.
+ */
+struct edmatch {
+	unsigned m_line;
+	unsigned m_pos;
+	unsigned m_len;
+};
+
+struct edsearch {
+	char *es_pat;
+	size_t es_patlen;
+	int es_regex;
+	regex_t es_re;
+
+	struct edmatch *es_match;
+	unsigned es_nmatch;
+	unsigned es_size;
+
+	/* scratch for rescanning lines */
+	struct edmatch *es_scratch;
+	unsigned es_nscratch;
+	unsigned es_ssize;
+};
+
+static int __match_push(struct edmatch **arr, unsigned *n, unsigned *size,
+		unsigned line, unsigned pos, unsigned len)
+{
+	if (*n == *size) {
+		unsigned sz = *size ? *size * 2 : 64;
+		struct edmatch *m = realloc(*arr, sz * sizeof(struct edmatch));
+
+		if (!m)
+			return -1;
+
+		*arr = m;
+		*size = sz;
+	}
+
+	(*arr)[*n].m_line = line;
+	(*arr)[*n].m_pos = pos;
+	(*arr)[(*n)++].m_len = len;
+
+	return 0;
+}
+
+/* append all matches in line @line to the scratch array */
+static int __search_line(struct edsearch *es, struct editor *e,
+		unsigned line)
+{
+	const char *text = editor_getline(e, line, NULL), *p;
+	regmatch_t rm;
+	int flags = 0;
+
+	if (!text)
+		return 0;
+
+	if (!es->es_regex) {
+		for (p = text; (p = strstr(p, es->es_pat)); p += es->es_patlen)
+			if (__match_push(&es->es_scratch, &es->es_nscratch,
+						&es->es_ssize, line, p - text,
+						es->es_patlen))
+				return -1;
+
+		return 0;
+	}
+
+	for (p = text; *p || p == text; flags = REG_NOTBOL) {
+		if (regexec(&es->es_re, p, 1, &rm, flags))
+			break;
+
+		if (__match_push(&es->es_scratch, &es->es_nscratch,
+					&es->es_ssize, line,
+					p - text + rm.rm_so,
+					rm.rm_eo - rm.rm_so))
+			return -1;
+
+		/* don't get stuck on empty matches */
+		p += rm.rm_eo > rm.rm_so ? rm.rm_eo : rm.rm_eo + 1;
+		if (p > text + strlen(text))
+			break;
+	}
+
+	return 0;
+}
+
+/* index of the first match at or after @line:@pos */
+static unsigned __lower_bound(struct edsearch *es, unsigned line,
+		unsigned pos)
+{
+	unsigned lo = 0, hi = es->es_nmatch, mid;
+	struct edmatch *m;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		m = &es->es_match[mid];
+		if (m->m_line < line || (m->m_line == line && m->m_pos < pos))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int search_create(struct editor *e, const char *pat, int regex)
+{
+	struct edsearch *es;
+	unsigned l;
+
+	if (e->e_search)
+		search_destroy(e);
+
+	es = calloc(1, sizeof(struct edsearch));
+	if (!es)
+		return -1;
+
+	es->es_regex = regex;
+	if (regex && regcomp(&es->es_re, pat, REG_EXTENDED | REG_NEWLINE)) {
+		free(es);
+		return -1;
+	}
+
+	es->es_pat = strdup(pat);
+	es->es_patlen = strlen(pat);
+	if (!es->es_pat || (!regex && !es->es_patlen))
+		goto out_free;
+
+	for (l = 0; l < e->e_lines; l++)
+		if (__search_line(es, e, l))
+			goto out_free;
+
+	/* the initial scan goes straight into the index */
+	es->es_match = es->es_scratch;
+	es->es_nmatch = es->es_nscratch;
+	es->es_size = es->es_ssize;
+	es->es_scratch = NULL;
+	es->es_nscratch = es->es_ssize = 0;
+
+	e->e_search = es;
+
+	return es->es_nmatch;
+
+out_free:
+	e->e_search = es;
+	search_destroy(e);
+
+	return -1;
+}
+
+void search_destroy(struct editor *e)
+{
+	struct edsearch *es = e->e_search;
+
+	if (!es)
+		return;
+
+	if (es->es_regex)
+		regfree(&es->es_re);
+
+	free(es->es_pat);
+	free(es->es_match);
+	free(es->es_scratch);
+	free(es);
+	e->e_search = NULL;
+}
+
+void search_update(struct editor *e, unsigned line, unsigned old,
+		unsigned new)
+{
+	struct edsearch *es = e->e_search;
+	unsigned lo, hi, i, n;
+
+	es->es_nscratch = 0;
+	for (i = line; i < line + new && i < e->e_lines; i++)
+		if (__search_line(es, e, i)) {
+			/* can't keep the index consistent */
+			search_destroy(e);
+			return;
+		}
+
+	lo = __lower_bound(es, line, 0);
+	hi = __lower_bound(es, line + old, 0);
+	n = es->es_nmatch - (hi - lo) + es->es_nscratch;
+
+	if (n > es->es_size) {
+		struct edmatch *m = realloc(es->es_match,
+				n * sizeof(struct edmatch));
+
+		if (!m) {
+			search_destroy(e);
+			return;
+		}
+
+		es->es_match = m;
+		es->es_size = n;
+	}
+
+	if (!n) {
+		es->es_nmatch = 0;
+		return;
+	}
+
+	memmove(es->es_match + lo + es->es_nscratch, es->es_match + hi,
+			(es->es_nmatch - hi) * sizeof(struct edmatch));
+	if (es->es_nscratch)
+		memcpy(es->es_match + lo, es->es_scratch,
+				es->es_nscratch * sizeof(struct edmatch));
+
+	if (new != old)
+		for (i = lo + es->es_nscratch; i < n; i++)
+			es->es_match[i].m_line += new - old;
+
+	es->es_nmatch = n;
+}
+
+/*
+ * Move the cursor to the next (@dir > 0) or previous match, wrapping
+ * around; returns the match index or -1
+ */
+int search_jump(struct editor *e, int dir)
+{
+	struct edsearch *es = e->e_search;
+	unsigned i, line, pos;
+
+	if (!es || !es->es_nmatch)
+		return -1;
+
+	line = e->e_curline == -1 ? 0 : e->e_curline;
+	pos = e->e_curpos;
+
+	if (dir > 0) {
+		i = __lower_bound(es, line, pos + 1);
+		if (i == es->es_nmatch)
+			i = 0;
+	} else {
+		i = __lower_bound(es, line, pos);
+		i = i ? i - 1 : es->es_nmatch - 1;
+	}
+
+	e->e_curline = es->es_match[i].m_line;
+	e->e_curpos = es->es_match[i].m_pos;
+
+	return i;
+}
+
+unsigned search_count(struct editor *e)
+{
+	return e->e_search ? e->e_search->es_nmatch : 0;
+}
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+
+/*
+ * Hierarchical timer wheel, the classic kind: OBBYWHEEL_LEVELS levels
+ * of OBBYWHEEL_SLOTS slots each, level n slots being OBBYWHEEL_SLOTS^n
+ * ticks wide. A timer goes to the level that covers its distance from
+ * now and is moved down a level every time the level below wraps, so
+ * arming, cancelling and firing are all O(1) no matter how many timers
+ * there are. Timers further away than the top level covers are clamped
+ * to the furthest slot and simply re-armed by whoever owns them.
+ */
+#define SLOT_MASK (OBBYWHEEL_SLOTS - 1)
+#define LEVEL_TICKS(__l) (1ULL << ((__l) * OBBYWHEEL_BITS))
+
+/*
+ * w_ticks is always the first tick that hasn't been run yet, i.e. the
+ * one after the tick @now_ms falls into, so that timers are never
+ * fired early
+ */
+void obbywheel_init(struct obbywheel *w, unsigned long long now_ms)
+{
+	memset(w, 0, sizeof(*w));
+	w->w_ticks = now_ms / OBBYWHEEL_TICK_MS + 1;
+}
+
+void obbytimer_init(struct obbytimer *t, obbytimer_fn_t fn, void *priv)
+{
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+	t->t_expires = 0;
+	t->t_fn = fn;
+	t->t_priv = priv;
+	t->t_wheel = NULL;
+}
+
+static void __timer_link(struct obbywheel *w, struct obbytimer *t)
+{
+	unsigned long long delta;
+	struct obbytimer **slot;
+	int l;
+
+	if (t->t_expires < w->w_ticks)
+		t->t_expires = w->w_ticks;
+
+	delta = t->t_expires - w->w_ticks;
+	if (delta >= LEVEL_TICKS(OBBYWHEEL_LEVELS)) {
+		delta = LEVEL_TICKS(OBBYWHEEL_LEVELS) - 1;
+		t->t_expires = w->w_ticks + delta;
+	}
+
+	for (l = 0; delta >= LEVEL_TICKS(l + 1); l++)
+		;
+
+	slot = &w->w_slots[l][(t->t_expires >> (l * OBBYWHEEL_BITS)) &
+		SLOT_MASK];
+
+	t->t_next = *slot;
+	if (t->t_next)
+		t->t_next->t_pprev = &t->t_next;
+	t->t_pprev = slot;
+	*slot = t;
+}
+
+static void __timer_unlink(struct obbytimer *t)
+{
+	*t->t_pprev = t->t_next;
+	if (t->t_next)
+		t->t_next->t_pprev = t->t_pprev;
+
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+}
+
+int obbytimer_pending(struct obbytimer *t)
+{
+	return t->t_pprev != NULL;
+}
+
+void obbytimer_cancel(struct obbytimer *t)
+{
+	if (!obbytimer_pending(t))
+		return;
+
+	__timer_unlink(t);
+	t->t_wheel->w_pending--;
+}
+
+/* (re)arm @t to fire @ms milliseconds from the wheel's current time */
+void obbytimer_arm(struct obbywheel *w, struct obbytimer *t, unsigned long ms)
+{
+	obbytimer_cancel(t);
+
+	t->t_wheel = w;
+	t->t_expires = w->w_ticks + (ms + OBBYWHEEL_TICK_MS - 1) /
+		OBBYWHEEL_TICK_MS;
+	__timer_link(w, t);
+	w->w_pending++;
+}
+
+/* move everything from slot @idx of level @l down to where it belongs */
+static void __cascade(struct obbywheel *w, int l, unsigned idx)
+{
+	struct obbytimer *t = w->w_slots[l][idx], *next;
+
+	w->w_slots[l][idx] = NULL;
+	for (; t; t = next) {
+		next = t->t_next;
+		__timer_link(w, t);
+	}
+}
+
+/*
+ * Fire all the timers that have expired by @now_ms
+ */
+void obbywheel_run(struct obbywheel *w, unsigned long long now_ms)
+{
+	unsigned long long target = now_ms / OBBYWHEEL_TICK_MS;
+	struct obbytimer *t, *due;
+	unsigned idx;
+	int l;
+
+	while (w->w_ticks <= target) {
+		if (!w->w_pending) {
+			w->w_ticks = target + 1;
+			break;
+		}
+
+		idx = w->w_ticks & SLOT_MASK;
+		for (l = 1; !idx && l < OBBYWHEEL_LEVELS; l++) {
+			idx = (w->w_ticks >> (l * OBBYWHEEL_BITS)) & SLOT_MASK;
+			__cascade(w, l, idx);
+		}
+
+		/*
+		 * take the due timers off the wheel and move on to the next
+		 * tick first, so that handlers that re-arm their timers (or
+		 * cancel others that are due) find the wheel consistent
+		 */
+		idx = w->w_ticks & SLOT_MASK;
+		due = w->w_slots[0][idx];
+		w->w_slots[0][idx] = NULL;
+		if (due)
+			due->t_pprev = &due;
+		w->w_ticks++;
+
+		while ((t = due) != NULL) {
+			__timer_unlink(t);
+			w->w_pending--;
+			t->t_fn(t, t->t_priv);
+		}
+	}
+}
+
+/*
+ * How long the caller can sleep before obbywheel_run() has work to do,
+ * at most @max_ms; this may be early (when the next thing due is a
+ * cascade rather than a timer), but never late
+ */
+long obbywheel_timeout(struct obbywheel *w, long max_ms,
+		unsigned long long now_ms)
+{
+	unsigned long long due;
+	unsigned idx;
+
+	if (!w->w_pending)
+		return max_ms;
+
+	/*
+	 * first non-empty level 0 slot before the wrap, if any; sitting
+	 * right on a wrap, the cascade there is due before anything else
+	 */
+	idx = w->w_ticks & SLOT_MASK;
+	if (idx)
+		for (; idx < OBBYWHEEL_SLOTS; idx++)
+			if (w->w_slots[0][idx])
+				break;
+
+	due = ((w->w_ticks & ~(unsigned long long)SLOT_MASK) + idx) *
+		OBBYWHEEL_TICK_MS;
+	if (due <= now_ms)
+		return 0;
+
+	return due - now_ms < max_ms ? due - now_ms : max_ms;
+}
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+
+/*
+ * Latency histograms, HDR style: values below 2^OBBYHIST_SUB_BITS get
+ * a bucket each, above that every power of two is split into
+ * 2^OBBYHIST_SUB_BITS linear sub-buckets, which keeps the relative
+ * error of any reported value under 1/2^OBBYHIST_SUB_BITS while the
+ * whole range of 64-bit nanoseconds fits in a few hundred counters.
+ */
+#define SUB_COUNT (1U << OBBYHIST_SUB_BITS)
+
+static unsigned __bucket(unsigned long long v)
+{
+	int shift;
+
+	if (v < SUB_COUNT)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - OBBYHIST_SUB_BITS;
+
+	return ((shift + 1) << OBBYHIST_SUB_BITS) +
+		((v >> shift) & (SUB_COUNT - 1));
+}
+
+/* highest value that falls into bucket @b */
+static unsigned long long __bucket_value(unsigned b)
+{
+	int shift;
+
+	if (b < SUB_COUNT)
+		return b;
+
+	shift = (b >> OBBYHIST_SUB_BITS) - 1;
+
+	return ((unsigned long long)(SUB_COUNT + (b & (SUB_COUNT - 1)) + 1)
+			<< shift) - 1;
+}
+
+void obbyhist_record(struct obbyhist *h, unsigned long long v)
+{
+	if (!h->h_count || v < h->h_min)
+		h->h_min = v;
+	if (v > h->h_max)
+		h->h_max = v;
+
+	h->h_count++;
+	h->h_sum += v;
+	h->h_buckets[__bucket(v)]++;
+}
+
+/*
+ * Value below which @p percent of the recorded values lie
+ */
+unsigned long long obbyhist_percentile(struct obbyhist *h, double p)
+{
+	unsigned long long want, seen = 0;
+	unsigned b;
+
+	if (!h->h_count)
+		return 0;
+
+	want = h->h_count * p / 100.0 + 0.5;
+	if (!want)
+		want = 1;
+
+	for (b = 0; b < OBBYHIST_BUCKETS; b++) {
+		seen += h->h_buckets[b];
+		if (seen >= want)
+			break;
+	}
+
+	if (b == OBBYHIST_BUCKETS || __bucket_value(b) > h->h_max)
+		return h->h_max;
+
+	return __bucket_value(b);
+}
+
+void obbyhist_reset(struct obbyhist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/* add what @src has recorded to @dst */
+void obbyhist_merge(struct obbyhist *dst, const struct obbyhist *src)
+{
+	unsigned b;
+
+	if (!src->h_count)
+		return;
+
+	if (!dst->h_count || src->h_min < dst->h_min)
+		dst->h_min = src->h_min;
+	if (src->h_max > dst->h_max)
+		dst->h_max = src->h_max;
+
+	dst->h_count += src->h_count;
+	dst->h_sum += src->h_sum;
+	for (b = 0; b < OBBYHIST_BUCKETS; b++)
+		dst->h_buckets[b] += src->h_buckets[b];
+}
+
+/*
+ * Span traces in Chrome's trace event format (chrome://tracing and
+ * perfetto both take it): a JSON array of complete events, which is
+ * allowed to be left unterminated if we die halfway
+ */
+struct obbytrace *obbytrace_open(const char *path)
+{
+	struct obbytrace *tr;
+
+	tr = malloc(sizeof(struct obbytrace));
+	if (!tr)
+		return NULL;
+
+	tr->tr_file = fopen(path, "w");
+	if (!tr->tr_file) {
+		free(tr);
+		return NULL;
+	}
+
+	tr->tr_base = obby_clock_ns();
+	tr->tr_pid = getpid();
+	tr->tr_nspans = 0;
+	fputs("[\n", tr->tr_file);
+
+	return tr;
+}
+
+void obbytrace_close(struct obbytrace *tr)
+{
+	fputs("\n]\n", tr->tr_file);
+	fclose(tr->tr_file);
+	free(tr);
+}
+
+void obbytrace_span(struct obbytrace *tr, const char *name, const char *cat,
+		int tid, unsigned long long start, unsigned long long end)
+{
+	fprintf(tr->tr_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			tr->tr_nspans++ ? ",\n" : "", name, cat, tr->tr_pid, tid,
+			(start - tr->tr_base) / 1000.0,
+			(end - start) / 1000.0);
+}
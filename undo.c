@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <string.h>
+#include <curses.h>
+#include "nobby-ui.h"
+
+/*
+ * Undo and redo. Our own changes to an editor's text go into an
+ * append-only log: each entry is what it takes to undo the change (or,
+ * once undone, to redo it), and whatever text that takes is kept once,
+ * in an arena next to the log. Typing and deleting runs of characters
+ * extend the last entry rather than adding one each.
+ *
+ * The log is a stack: entries below u_top can be undone, the last one
+ * first, and those from u_top on redone, the first one first. Each is
+ * kept in terms of the text as it will be by the time its turn comes,
+ * which for the next one either way is the text as it is now, so that
+ * undoing and redoing are just a matter of applying it.
+ *
+ * Other users' changes are not logged, but carried into every entry as
+ * they come, working outwards from the current text. One that touches
+ * text an entry would delete makes that entry, and everything that
+ * depends on it, impossible to undo (or redo): those are dropped.
+ *
+ * The log is kept under a limit by dropping its oldest half whenever
+ * it goes over: what's in there can no longer be undone.
+ */
+enum {
+	EDOP_INSERT = 0,
+	EDOP_DELETE,
+};
+
+struct edop {
+	size_t o_off;
+	size_t o_len;
+	size_t o_text;		/* offset into the arena */
+	int o_type;
+};
+
+struct edundo {
+	struct edop *u_ops;
+	size_t u_nops;
+	size_t u_top;		/* entries below can be undone, the rest redone */
+	size_t u_size;
+	char *u_arena;
+	size_t u_used;
+	size_t u_asize;
+	size_t u_max;		/* bytes of entries and text kept */
+	int u_break;		/* don't extend the last entry */
+};
+
+struct edundo *edundo_create(size_t max)
+{
+	struct edundo *u;
+
+	u = calloc(1, sizeof(struct edundo));
+	if (!u)
+		return NULL;
+
+	u->u_max = max;
+
+	return u;
+}
+
+void edundo_destroy(struct edundo *u)
+{
+	free(u->u_ops);
+	free(u->u_arena);
+	free(u);
+}
+
+/* forget everything, the text having been replaced as a whole */
+void edundo_clear(struct edundo *u)
+{
+	u->u_nops = 0;
+	u->u_top = 0;
+	u->u_used = 0;
+	u->u_break = 0;
+}
+
+/* start a new entry with the next change, even if it could extend */
+void edundo_break(struct edundo *u)
+{
+	u->u_break = 1;
+}
+
+/* drop the oldest @n entries; their text is the first in the arena */
+static void __drop_oldest(struct edundo *u, size_t n)
+{
+	size_t i, min;
+
+	if (n >= u->u_nops) {
+		edundo_clear(u);
+		return;
+	}
+
+	min = u->u_ops[n].o_text;
+	memmove(u->u_ops, u->u_ops + n, (u->u_nops - n) * sizeof(struct edop));
+	u->u_nops -= n;
+	u->u_top = u->u_top > n ? u->u_top - n : 0;
+
+	memmove(u->u_arena, u->u_arena + min, u->u_used - min);
+	u->u_used -= min;
+	for (i = 0; i < u->u_nops; i++)
+		u->u_ops[i].o_text -= min;
+}
+
+/* drop entries from @n on, and the last of the text with them */
+static void __drop_newest(struct edundo *u, size_t n)
+{
+	if (n >= u->u_nops)
+		return;
+
+	u->u_used = u->u_ops[n].o_text;
+	u->u_nops = n;
+	if (u->u_top > n)
+		u->u_top = n;
+}
+
+static void __limit(struct edundo *u)
+{
+	while (u->u_nops &&
+			u->u_nops * sizeof(struct edop) + u->u_used > u->u_max)
+		__drop_oldest(u, (u->u_nops + 1) / 2);
+}
+
+/* a new entry to undo; whatever there was to redo is gone */
+static struct edop *__push(struct edundo *u, int type, size_t off)
+{
+	struct edop *ops, *o;
+	size_t size;
+
+	__drop_newest(u, u->u_top);
+	if (u->u_nops == u->u_size) {
+		size = u->u_size ? u->u_size * 2 : 64;
+		ops = realloc(u->u_ops, size * sizeof(struct edop));
+		if (!ops)
+			return NULL;
+
+		u->u_ops = ops;
+		u->u_size = size;
+	}
+
+	o = &u->u_ops[u->u_nops++];
+	u->u_top = u->u_nops;
+
+	o->o_type = type;
+	o->o_off = off;
+	o->o_len = 0;
+	o->o_text = u->u_used;
+
+	return o;
+}
+
+/* room for @len more bytes of text */
+static char *__text(struct edundo *u, size_t len)
+{
+	size_t size = u->u_asize ? u->u_asize : 4096;
+	char *arena;
+
+	if (u->u_used + len > u->u_asize) {
+		while (size < u->u_used + len)
+			size *= 2;
+
+		arena = realloc(u->u_arena, size);
+		if (!arena)
+			return NULL;
+
+		u->u_arena = arena;
+		u->u_asize = size;
+	}
+
+	return u->u_arena + u->u_used;
+}
+
+/*
+ * The last entry, if it undoes with a @type and the next change of ours
+ * may extend it: nothing was undone since, so its text is the last
+ */
+static struct edop *__last(struct edundo *u, int type)
+{
+	struct edop *o;
+
+	if (!u->u_top || u->u_top != u->u_nops || u->u_break)
+		return NULL;
+
+	o = &u->u_ops[u->u_top - 1];
+
+	return o->o_type == type ? o : NULL;
+}
+
+static int __space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+/*
+ * Make @a, which applied to the same text as @b, apply to the text @b
+ * leaves; where both insert at the same place, @b's text comes first if
+ * @b_first. Returns -1 if @b touches text that @a deletes.
+ */
+static int __transform(struct edop *a, const struct edop *b, int b_first)
+{
+	size_t aend = a->o_off + a->o_len, bend = b->o_off + b->o_len;
+	size_t lo, hi;
+
+	if (b->o_type == EDOP_INSERT) {
+		if (b->o_off < a->o_off || (b->o_off == a->o_off &&
+					(b_first || a->o_type == EDOP_DELETE)))
+			a->o_off += b->o_len;
+		else if (a->o_type == EDOP_DELETE && b->o_off < aend) {
+			a->o_len += b->o_len;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (bend <= a->o_off) {
+		a->o_off -= b->o_len;
+		return 0;
+	}
+
+	/* an insertion point inside the deleted text moves to its start */
+	if (a->o_type == EDOP_INSERT) {
+		if (b->o_off < a->o_off)
+			a->o_off = b->o_off;
+		return 0;
+	}
+
+	if (b->o_off >= aend)
+		return 0;
+
+	lo = b->o_off > a->o_off ? b->o_off : a->o_off;
+	hi = bend < aend ? bend : aend;
+	a->o_len -= hi - lo;
+	if (b->o_off < a->o_off)
+		a->o_off = b->o_off;
+
+	return -1;
+}
+
+/*
+ * Carry somebody else's insertion (@ins set) or deletion of @len bytes
+ * at @off into every entry
+ */
+static void __remote(struct edundo *u, int ins, size_t off, size_t len)
+{
+	struct edop r, o;
+	size_t i, bad = 0;
+
+	r.o_type = ins ? EDOP_INSERT : EDOP_DELETE;
+	r.o_off = off;
+	r.o_len = len;
+
+	/*
+	 * Each entry to undo is a step further back from the current text,
+	 * and each to redo a step further forward; where the change and an
+	 * entry insert at the same place, the change's text comes first
+	 */
+	for (i = u->u_top; i-- > 0;) {
+		o = u->u_ops[i];
+		if (__transform(&u->u_ops[i], &r, 1) && !bad)
+			bad = i + 1;
+		__transform(&r, &o, 0);
+	}
+
+	r.o_off = off;
+	r.o_len = len;
+	for (i = u->u_top; i < u->u_nops; i++) {
+		o = u->u_ops[i];
+		if (__transform(&u->u_ops[i], &r, 1)) {
+			__drop_newest(u, i);
+			break;
+		}
+		__transform(&r, &o, 0);
+	}
+
+	if (bad)
+		__drop_oldest(u, bad);
+}
+
+/*
+ * Log the insertion of @len bytes of @buf at @off, by us if @local;
+ * returns -1 if out of memory, in which case the log is gone
+ */
+int edundo_insert(struct edundo *u, size_t off, const char *buf, size_t len,
+		int local)
+{
+	struct edop *o;
+	char *text;
+
+	if (!len)
+		return 0;
+
+	if (!local) {
+		__remote(u, 1, off, len);
+		u->u_break = 1;
+		return 0;
+	}
+
+	text = __text(u, len);
+	if (!text)
+		goto oom;
+
+	/* undone by deleting it again, a word at a time */
+	o = __last(u, EDOP_DELETE);
+	if (!o || off != o->o_off + o->o_len ||
+			(__space(text[-1]) && !__space(*buf))) {
+		o = __push(u, EDOP_DELETE, off);
+		if (!o)
+			goto oom;
+		text = u->u_arena + u->u_used;
+	}
+
+	memcpy(text, buf, len);
+	u->u_used += len;
+	o->o_len += len;
+	u->u_break = 0;
+	__limit(u);
+
+	return 0;
+
+oom:
+	edundo_clear(u);
+	return -1;
+}
+
+/*
+ * Log the deletion of @len bytes at @off from @r, the text as it is
+ * before the deletion
+ */
+int edundo_delete(struct edundo *u, struct rope *r, size_t off, size_t len,
+		int local)
+{
+	struct edop *o;
+	char *text;
+
+	if (!len)
+		return 0;
+
+	if (!local) {
+		__remote(u, 0, off, len);
+		u->u_break = 1;
+		return 0;
+	}
+
+	if (!__text(u, len))
+		goto oom;
+
+	/* undone by putting it back */
+	o = __last(u, EDOP_INSERT);
+	if (o && off == o->o_off) {
+		/* deleting forward */
+		rope_copy(r, off, len, u->u_arena + u->u_used);
+	} else if (o && off + len == o->o_off) {
+		/* and backward */
+		text = u->u_arena + o->o_text;
+		memmove(text + len, text, o->o_len);
+		rope_copy(r, off, len, text);
+		o->o_off = off;
+	} else {
+		o = __push(u, EDOP_INSERT, off);
+		if (!o)
+			goto oom;
+		rope_copy(r, off, len, u->u_arena + u->u_used);
+	}
+
+	u->u_used += len;
+	o->o_len += len;
+	u->u_break = 0;
+	__limit(u);
+
+	return 0;
+
+oom:
+	edundo_clear(u);
+	return -1;
+}
+
+/*
+ * Take the next change to undo (or with @redo, to redo), which is up to
+ * the caller to make to the text as it is now: an insertion (*@ins set)
+ * of *@len bytes of *@text, or a deletion, at *@off. The text is valid
+ * until the next change is logged. Returns 1 if there is one, 0 if not.
+ */
+int edundo_step(struct edundo *u, int redo, size_t *off, size_t *len,
+		const char **text, int *ins)
+{
+	struct edop *o;
+
+	if (redo ? u->u_top == u->u_nops : !u->u_top)
+		return 0;
+
+	o = &u->u_ops[redo ? u->u_top++ : --u->u_top];
+	*off = o->o_off;
+	*len = o->o_len;
+	*text = u->u_arena + o->o_text;
+	*ins = o->o_type == EDOP_INSERT;
+
+	/* from now on, it's what it takes to do the opposite */
+	o->o_type = o->o_type == EDOP_INSERT ? EDOP_DELETE : EDOP_INSERT;
+	u->u_break = 1;
+
+	return 1;
+}
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <gnutls/gnutls.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cobby.h"
+
+/*
+ * UTF-8 checking. Document text is overwhelmingly ASCII, so the ASCII
+ * runs are skipped 16 bytes at a time with SSE2 (8 at a time with
+ * plain 64-bit words elsewhere) and only the multibyte sequences are
+ * decoded one by one. Decoding is strict: overlong forms, surrogates
+ * and anything past U+10FFFF are invalid.
+ */
+#define HIGH_BITS 0x8080808080808080ULL
+
+/* length of the run of ASCII bytes @s starts with */
+static size_t __ascii_run(const unsigned char *s, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		int m = _mm_movemask_epi8(_mm_loadu_si128(
+					(const __m128i *)(s + i)));
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long v;
+
+		memcpy(&v, s + i, 8);
+		if (v & HIGH_BITS)
+			break;
+	}
+#endif
+
+	while (i < len && s[i] < 0x80)
+		i++;
+
+	return i;
+}
+
+/*
+ * Decode the character at @buf into *@cp; returns its length in bytes,
+ * or -1 if it's not valid UTF-8, in which case *@cp is U+FFFD and the
+ * caller should skip a single byte
+ */
+int obby_utf8_decode(const char *buf, size_t len, unsigned *cp)
+{
+	const unsigned char *s = (const unsigned char *)buf;
+	unsigned c, min;
+	int n, i;
+
+	if (!len)
+		goto bad;
+
+	c = s[0];
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	}
+
+	if (c < 0xc2)
+		goto bad;
+	else if (c < 0xe0) {
+		n = 2;
+		c &= 0x1f;
+		min = 0x80;
+	} else if (c < 0xf0) {
+		n = 3;
+		c &= 0x0f;
+		min = 0x800;
+	} else if (c < 0xf5) {
+		n = 4;
+		c &= 0x07;
+		min = 0x10000;
+	} else
+		goto bad;
+
+	if (len < n)
+		goto bad;
+
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			goto bad;
+
+		c = c << 6 | (s[i] & 0x3f);
+	}
+
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+		goto bad;
+
+	*cp = c;
+	return n;
+
+bad:
+	*cp = 0xfffd;
+	return -1;
+}
+
+/*
+ * Offset of the first byte in @buf that isn't part of a valid UTF-8
+ * sequence, @len if there is none
+ */
+size_t obby_utf8_valid(const char *buf, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)buf;
+	size_t i = 0;
+	unsigned cp;
+	int n;
+
+	for (;;) {
+		i += __ascii_run(s + i, len - i);
+		if (i == len)
+			return len;
+
+		n = obby_utf8_decode(buf + i, len - i, &cp);
+		if (n < 0)
+			return i;
+
+		i += n;
+	}
+}
+
+/*
+ * Replace every byte of @buf that isn't valid UTF-8 with '?', which
+ * keeps byte offsets into it intact; returns how many were replaced
+ */
+size_t obby_utf8_scrub(char *buf, size_t len)
+{
+	size_t i = 0, bad = 0;
+
+	while ((i += obby_utf8_valid(buf + i, len - i)) < len) {
+		buf[i++] = '?';
+		bad++;
+	}
+
+	return bad;
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <curses.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+#include "nobby-ui.h"
+
+/*
+ * Viewport of an editor's text on its window: only lines e_top to
+ * e_top + e_rows are ever looked at. Edits and scrolling mark the rows
+ * they affect in e_dirty, shifting whatever is already on screen with
+ * insert/delete line and scroll regions rather than redrawing it, and
+ * editor_render() then draws just the dirty rows, using the cached
+ * line layouts from width.c. The cost of a redraw depends on the window
+ * size, not the document size.
+ */
+static void __dirty(struct editor *e, unsigned from, unsigned to)
+{
+	if (to > e->e_rows)
+		to = e->e_rows;
+
+	if (from < to)
+		memset(e->e_dirty + from, 1, to - from);
+}
+
+/*
+ * Rows from @row down have moved by @n (down if positive) on screen;
+ * move their dirty flags along and mark the rows left blank
+ */
+static void __shift(struct editor *e, unsigned row, int n)
+{
+	unsigned left = e->e_rows - row, m = abs(n);
+
+	if (m >= left) {
+		__dirty(e, row, e->e_rows);
+		return;
+	}
+
+	if (n > 0) {
+		memmove(e->e_dirty + row + m, e->e_dirty + row, left - m);
+		__dirty(e, row, row + m);
+	} else {
+		memmove(e->e_dirty + row, e->e_dirty + row + m, left - m);
+		__dirty(e, e->e_rows - m, e->e_rows);
+	}
+}
+
+/* (re)size the viewport to the editor's window and redraw everything */
+int editor_view_resize(struct editor *e)
+{
+	unsigned rows = getmaxy(e->e_win);
+	unsigned char *d;
+
+	d = realloc(e->e_dirty, rows ? rows : 1);
+	if (!d)
+		return -1;
+
+	e->e_dirty = d;
+	e->e_rows = rows;
+	__dirty(e, 0, rows);
+	idlok(e->e_win, TRUE);
+
+	return 0;
+}
+
+/*
+ * Lines [@line, @line + @old) have been replaced with @new lines: keep
+ * what's on screen in place, or move it along with the text
+ */
+void editor_view_changed(struct editor *e, unsigned line, unsigned old,
+		unsigned new)
+{
+	unsigned top = e->e_top, row, keep;
+
+	if (!e->e_dirty)
+		return;
+
+	if (!e->e_lines) {
+		e->e_top = 0;
+		__dirty(e, 0, e->e_rows);
+		return;
+	}
+
+	/* below the viewport, nothing to see */
+	if (line >= top + e->e_rows)
+		return;
+
+	/* above it, the same text stays in view on different lines */
+	if (line + old <= top) {
+		e->e_top = top + new - old;
+		return;
+	}
+
+	/* straddling the top, so the first line shown is gone */
+	if (line < top) {
+		e->e_top = line;
+		__dirty(e, 0, e->e_rows);
+		return;
+	}
+
+	row = line - top;
+	keep = old < new ? old : new;
+	__dirty(e, row, row + keep);
+
+	if (new == old || row + keep >= e->e_rows)
+		return;
+
+	wmove(e->e_win, row + keep, 0);
+	winsdelln(e->e_win, (int)new - (int)old);
+	__shift(e, row + keep, (int)new - (int)old);
+}
+
+/* scroll the view by @delta lines, down the text if positive */
+void editor_scroll(struct editor *e, int delta)
+{
+	long top = (long)e->e_top + delta, max;
+
+	if (!e->e_dirty)
+		return;
+
+	max = e->e_lines > e->e_rows ? e->e_lines - e->e_rows : 0;
+	if (top > max)
+		top = max;
+	if (top < 0)
+		top = 0;
+
+	delta = top - e->e_top;
+	if (!delta)
+		return;
+
+	e->e_top = top;
+	if (abs(delta) >= e->e_rows) {
+		__dirty(e, 0, e->e_rows);
+		return;
+	}
+
+	scrollok(e->e_win, TRUE);
+	wscrl(e->e_win, delta);
+	scrollok(e->e_win, FALSE);
+	__shift(e, 0, -delta);
+}
+
+/* bring @line into view, a third of the way down if it wasn't */
+void editor_view_show(struct editor *e, unsigned line)
+{
+	if (line >= e->e_top && line < e->e_top + e->e_rows)
+		return;
+
+	editor_scroll(e, (int)line - (int)e->e_top - e->e_rows / 3);
+}
+
+/*
+ * Draw @text, whose layout is @w, at row @row, cluster by cluster up to
+ * the first one that doesn't fit
+ */
+static void __render_line(struct editor *e, unsigned row,
+		const struct edwidth *w, const char *text)
+{
+	unsigned cols = getmaxx(e->e_win), c, x;
+	unsigned off, len, cp;
+
+	wmove(e->e_win, row, 0);
+	for (c = 0; c < w->w_n && w->w_col[c + 1] <= cols; c++) {
+		off = w->w_off[c];
+		len = w->w_off[c + 1] - off;
+
+		if (text[off] == '\t') {
+			for (x = w->w_col[c]; x < w->w_col[c + 1]; x++)
+				waddch(e->e_win, ' ');
+		} else if (obby_utf8_decode(text + off, len, &cp) < 0 ||
+				cp < ' ' || cp == 0x7f)
+			waddch(e->e_win, '?' | A_REVERSE);
+		else
+			waddnstr(e->e_win, text + off, len);
+	}
+
+	if (w->w_col[c] < cols)
+		wclrtoeol(e->e_win);
+}
+
+/* draw the dirty rows of the viewport */
+void editor_render(struct editor *e)
+{
+	const struct edwidth *w;
+	const char *text;
+	unsigned row;
+
+	for (row = 0; row < e->e_rows; row++) {
+		if (!e->e_dirty[row])
+			continue;
+
+		w = editor_width(e, e->e_top + row);
+		text = editor_getline(e, e->e_top + row, NULL);
+		if (w && text)
+			__render_line(e, row, w, text);
+		else {
+			wmove(e->e_win, row, 0);
+			wclrtoeol(e->e_win);
+		}
+
+		e->e_dirty[row] = 0;
+	}
+}
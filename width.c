@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <curses.h>
+#include <gnutls/gnutls.h>
+#include "cobby.h"
+#include "nobby-ui.h"
+
+/*
+ * Display layout of lines: where each character cluster starts in the
+ * line and on screen. A cluster is a character with whatever zero width
+ * characters (combining marks, joiners, variation selectors) follow it,
+ * which is what the cursor steps over and what gets drawn as a unit.
+ *
+ * Working that out means decoding the whole line, so the layouts of
+ * the last EDWIDTH_CACHE lines asked for are kept, direct mapped by
+ * line number, and dropped when editor_changed() says the line (or,
+ * if lines were added or removed, anything from it on) has changed.
+ */
+static int __grow(struct edwidth *w)
+{
+	unsigned size = w->w_size ? w->w_size * 2 : 64;
+	unsigned *off, *col;
+
+	off = realloc(w->w_off, size * sizeof(unsigned));
+	if (!off)
+		return -1;
+	w->w_off = off;
+
+	col = realloc(w->w_col, size * sizeof(unsigned));
+	if (!col)
+		return -1;
+	w->w_col = col;
+
+	w->w_size = size;
+
+	return 0;
+}
+
+static int __layout(struct edwidth *w, const char *text, size_t len)
+{
+	unsigned col = 0, cp;
+	size_t i = 0;
+	int n, cw;
+
+	w->w_n = 0;
+	while (i <= len) {
+		if (w->w_n + 1 >= w->w_size && __grow(w))
+			return -1;
+
+		/* the end goes in as a last, empty cluster */
+		if (i == len) {
+			w->w_off[w->w_n] = len;
+			w->w_col[w->w_n] = col;
+			break;
+		}
+
+		n = obby_utf8_decode(text + i, len - i, &cp);
+		if (n < 0) {
+			n = 1;
+			cw = 1;
+		} else if (cp == '\t')
+			cw = EDITOR_TABSTOP - col % EDITOR_TABSTOP;
+		else if (cp < ' ' || cp == 0x7f)
+			cw = 1;
+		else if ((cw = wcwidth(cp)) < 0)
+			cw = 1;
+
+		if (!cw && w->w_n) {
+			i += n;
+			continue;
+		}
+
+		w->w_off[w->w_n] = i;
+		w->w_col[w->w_n++] = col;
+		col += cw;
+		i += n;
+	}
+
+	w->w_width = col;
+
+	return 0;
+}
+
+/*
+ * Layout of line @line, NULL if there's no such line (or no memory);
+ * valid until the next edit or the next call
+ */
+const struct edwidth *editor_width(struct editor *e, unsigned line)
+{
+	struct edwidth *w;
+	const char *text;
+	size_t len;
+
+	if (line >= e->e_lines)
+		return NULL;
+
+	if (!e->e_width) {
+		e->e_width = calloc(EDWIDTH_CACHE, sizeof(struct edwidth));
+		if (!e->e_width)
+			return NULL;
+	}
+
+	w = &e->e_width[line % EDWIDTH_CACHE];
+	if (w->w_valid && w->w_line == line)
+		return w;
+
+	text = editor_getline(e, line, &len);
+	if (!text)
+		return NULL;
+
+	w->w_valid = 0;
+	if (__layout(w, text, len))
+		return NULL;
+
+	w->w_line = line;
+	w->w_valid = 1;
+
+	return w;
+}
+
+void editor_width_changed(struct editor *e, unsigned line, unsigned old,
+		unsigned new)
+{
+	unsigned i, end = new == old ? line + old : -1U;
+
+	if (!e->e_width)
+		return;
+
+	for (i = 0; i < EDWIDTH_CACHE; i++)
+		if (e->e_width[i].w_line >= line && e->e_width[i].w_line < end)
+			e->e_width[i].w_valid = 0;
+}
+
+void editor_width_free(struct editor *e)
+{
+	unsigned i;
+
+	if (!e->e_width)
+		return;
+
+	for (i = 0; i < EDWIDTH_CACHE; i++) {
+		free(e->e_width[i].w_off);
+		free(e->e_width[i].w_col);
+	}
+
+	free(e->e_width);
+	e->e_width = NULL;
+}
+
+/* index of the cluster byte @pos is in */
+static unsigned __cluster(const struct edwidth *w, unsigned pos)
+{
+	unsigned lo = 0, hi = w->w_n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (w->w_off[mid] <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/* screen column of byte @pos of line @line */
+unsigned editor_column(struct editor *e, unsigned line, unsigned pos)
+{
+	const struct edwidth *w = editor_width(e, line);
+
+	return w ? w->w_col[__cluster(w, pos)] : pos;
+}
+
+/*
+ * Byte offset of the cluster before (@dir < 0) or after the one that
+ * byte @pos of line @line is in
+ */
+unsigned editor_stepchar(struct editor *e, unsigned line, unsigned pos,
+		int dir)
+{
+	const struct edwidth *w = editor_width(e, line);
+	unsigned c;
+
+	if (!w)
+		return pos;
+
+	c = __cluster(w, pos);
+	if (dir < 0)
+		return w->w_off[w->w_off[c] < pos ? c : c ? c - 1 : 0];
+
+	return w->w_off[c < w->w_n ? c + 1 : c];
+}